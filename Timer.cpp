@@ -4,38 +4,1287 @@
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <chrono>
 #include <vector>
 #include <unordered_map>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <thread>
+#include <exception>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "Timer.h"
+#include "TimerTrace.h"
+#include "TimerAlloc.h"
+
+#if TIMER_CLOCK == TIMER_CLOCK_TSC
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#error "TIMER_CLOCK_TSC requires an x86 processor"
+#endif
+#endif
 
 namespace {
+    constexpr std::size_t kChunkBits = 10;
+    constexpr std::size_t kChunkSize = std::size_t{1} << kChunkBits;
+    constexpr std::size_t kMaxChunks = 1024;
+    // node id of a lookup that found nothing
+    constexpr uint32_t kNoNode = 0xffffffffu;
+
+    // kChunkSize * kMaxChunks elements allocated chunk by chunk, chunks never move so that elements can be read
+    // without a lock while another thread allocates a new chunk
+    template<typename T>
+    struct StableArray {
+        std::atomic<T *> chunks_[kMaxChunks]{};
+
+        ~StableArray() {
+            for (auto &chunk: chunks_)
+                delete[] chunk.load(std::memory_order_relaxed);
+        }
+
+        T *find(std::size_t index) const {
+            T *chunk = chunks_[index >> kChunkBits].load(std::memory_order_acquire);
+            return chunk == nullptr ? nullptr : &chunk[index & (kChunkSize - 1)];
+        }
+
+        // allocations are serialized by the caller
+        T &Ensure(std::size_t index) {
+            T *chunk = chunks_[index >> kChunkBits].load(std::memory_order_relaxed);
+            if (chunk == nullptr) {
+                chunk = new T[kChunkSize]();
+                chunks_[index >> kChunkBits].store(chunk, std::memory_order_release);
+            }
+            return chunk[index & (kChunkSize - 1)];
+        }
+    };
+
+    // Open-addressed map from name id to child node id, kept at most half full. Lookups are lock-free, insertions
+    // happen under RelationTree::mutex_ and a full table is replaced by a larger copy while readers may still use it.
+    struct ChildTable {
+        explicit ChildTable(std::size_t capacity)
+                : mask_(capacity - 1), entries_(new std::atomic<uint64_t>[capacity]()) {}
+
+        const std::size_t mask_;
+        std::size_t size_{0};
+        // 0 is empty, otherwise (name id + 1) << 32 | node id, the node id is kNoNode once the child is erased
+        const std::unique_ptr<std::atomic<uint64_t>[]> entries_;
+
+        std::size_t getSlot(uint32_t name_id) const {
+            return static_cast<std::size_t>((name_id * 0x9E3779B97F4A7C15ull) >> 32) & mask_;
+        }
+
+        uint32_t Find(uint32_t name_id) const {
+            const uint64_t key = uint64_t{name_id} + 1;
+            for (std::size_t slot = getSlot(name_id);; slot = (slot + 1) & mask_) {
+                const uint64_t entry = entries_[slot].load(std::memory_order_acquire);
+                if (entry == 0)
+                    return kNoNode;
+                if (entry >> 32 == key)
+                    return static_cast<uint32_t>(entry);
+            }
+        }
+
+        // returns false when the table is too full, the caller then grows it
+        bool Insert(uint32_t name_id, uint32_t node_id) {
+            const uint64_t key = uint64_t{name_id} + 1;
+            std::size_t slot = getSlot(name_id);
+            for (;; slot = (slot + 1) & mask_) {
+                const uint64_t entry = entries_[slot].load(std::memory_order_relaxed);
+                if (entry == 0)
+                    break;
+                if (entry >> 32 == key) {
+                    entries_[slot].store(key << 32 | node_id, std::memory_order_release);
+                    return true;
+                }
+            }
+            if (2 * (size_ + 1) > mask_ + 1)
+                return false;
+            ++size_;
+            entries_[slot].store(key << 32 | node_id, std::memory_order_release);
+            return true;
+        }
+    };
+
+    // Read-only view of a node for the recording threads, indexed by RelationNode::id_
+    struct NodeInfo {
+        std::atomic<ChildTable *> children_;
+        uint32_t name_id_;
+        Timer::TimeUnit_t time_unit_;
+        // one in period_ invocations is recorded, 0 for a node outside of the tree which is always recorded
+        std::atomic<uint32_t> period_;
+        // exemplars kept per thread and their minimum duration in the node time unit, see ExemplarBuffer
+        std::atomic<uint32_t> exemplars_;
+        std::atomic<double> exemplar_threshold_;
+
+        ~NodeInfo() { delete children_.load(std::memory_order_relaxed); }
+    };
+
     struct RelationTree {
         RelationTree() = delete;
 
-        struct RelationNode {
-            RelationNode() = delete;
+        struct RelationNode {
+            RelationNode() = delete;
+
+            std::unordered_map<std::string, std::unique_ptr<RelationNode>> descendants_{};
+            const RelationNode *parent;
+            // index into the thread tables, handed out to users as Timer::Handle
+            const std::size_t id_;
+            const uint32_t name_id_;
+            const Timer::TimeUnit_t time_unit_;
+
+            RelationNode(const RelationNode *father_ptr, std::size_t id, uint32_t name_id, Timer::TimeUnit_t time_unit);
+
+            ~RelationNode();
+        };
+
+        // guards the tree and the thread list, never taken when recording through a handle
+        static std::mutex mutex_;
+        // nodes registered with an explicit father, whose names are unique
+        static std::unordered_map<std::string, const RelationNode *> plain_nodes_;
+        // interned names and every node carrying them, indexed by name id
+        static std::unordered_map<std::string, uint32_t> name_ids_;
+        static std::vector<std::string> names_;
+        static std::vector<std::vector<const RelationNode *>> name_nodes_;
+        // sampling period given to the nodes carrying the name, indexed by name id
+        static std::vector<uint32_t> periods_;
+        // exemplar count and threshold given to the nodes carrying the name, indexed by name id
+        static std::vector<std::pair<uint32_t, double>> exemplars_;
+        // indexed by RelationNode::id_, nullptr once the node is erased
+        static std::vector<const RelationNode *> node_table_;
+        static StableArray<NodeInfo> node_info_;
+        // replaced child tables, lookups in flight may still read them
+        static std::vector<std::unique_ptr<ChildTable>> retired_children_;
+        // attach recorders started without a father to the innermost active scope of the thread
+        static std::atomic<bool> auto_parent_;
+        // node id outside of the tree on which Calibrate measures, kNoNode until the first calibration. It is kept
+        // out of the traces and the exemplars.
+        static std::atomic<uint32_t> calibration_id_;
+        const static std::unique_ptr<RelationNode> root_;
+
+        static const RelationTree::RelationNode *getNodePtr(const std::string &name);
+
+        // names from below the root down to the node, joined by '/'
+        static std::string getPath(const RelationNode *node_ptr);
+
+        static uint32_t getNameId(const std::string &name);
+
+        // a name id that no name looks up, so that the root cannot be reached or erased through a user name
+        static uint32_t ReserveNameId(const std::string &name);
+
+        static const RelationTree::RelationNode *
+        Register(const std::string &name, const RelationNode *father_ptr, Timer::TimeUnit_t time_unit);
+
+        // child of the given node carrying the given name, created when missing
+        static const RelationTree::RelationNode *
+        getChild(const RelationNode *father_ptr, uint32_t name_id, Timer::TimeUnit_t time_unit);
+
+        // lock-free, kNoNode when the child does not exist yet
+        static uint32_t FindChild(std::size_t father_id, uint32_t name_id) {
+            const NodeInfo *info = node_info_.find(father_id);
+            const ChildTable *children = info == nullptr ? nullptr : info->children_.load(std::memory_order_acquire);
+            return children == nullptr ? kNoNode : children->Find(name_id);
+        }
+    };
+
+    typedef int64_t Tick_t;
+    // an end of recording the clock has not been read for yet
+    constexpr Tick_t kUnread = std::numeric_limits<Tick_t>::min();
+
+    // Clock policies selected by TIMER_CLOCK, Now() returns raw ticks that are only converted when reporting
+    template<int>
+    struct ClockSource;
+
+    template<>
+    struct ClockSource<TIMER_CLOCK_STEADY> {
+        static Tick_t Now() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+
+        static long double getTicksPerSecond() {
+            typedef std::chrono::steady_clock::period Tick_p;
+            return static_cast<long double>(Tick_p::den) / Tick_p::num;
+        }
+    };
+
+#if TIMER_CLOCK == TIMER_CLOCK_MONOTONIC_RAW
+    // not slewed by NTP, nanosecond ticks
+    template<>
+    struct ClockSource<TIMER_CLOCK_MONOTONIC_RAW> {
+        static Tick_t Now() {
+            timespec time_spec{};
+            clock_gettime(CLOCK_MONOTONIC_RAW, &time_spec);
+            return static_cast<Tick_t>(time_spec.tv_sec) * 1000000000 + time_spec.tv_nsec;
+        }
+
+        static long double getTicksPerSecond() { return 1e9L; }
+    };
+#endif
+
+#if TIMER_CLOCK == TIMER_CLOCK_TSC
+    // Time stamp counter, assumes an invariant TSC. Its frequency is calibrated once against steady_clock at startup.
+    template<>
+    struct ClockSource<TIMER_CLOCK_TSC> {
+        static Tick_t Now() {
+            unsigned int aux;
+            return static_cast<Tick_t>(__rdtscp(&aux));
+        }
+
+        static long double getTicksPerSecond() { return ticks_per_second_; }
+
+    private:
+        static long double Calibrate() {
+            const auto steady_start = std::chrono::steady_clock::now();
+            const Tick_t tsc_start = Now();
+            std::chrono::steady_clock::time_point steady_end;
+            do {
+                steady_end = std::chrono::steady_clock::now();
+            } while (steady_end - steady_start < std::chrono::milliseconds{10});
+            const Tick_t tsc_end = Now();
+            const std::chrono::duration<long double> elapsed = steady_end - steady_start;
+            return (tsc_end - tsc_start) / elapsed.count();
+        }
+
+        static const long double ticks_per_second_;
+    };
+
+    const long double ClockSource<TIMER_CLOCK_TSC>::ticks_per_second_{Calibrate()};
+#endif
+
+    typedef ClockSource<TIMER_CLOCK> Clock_t;
+
+    inline Tick_t ReadClock() { return Clock_t::Now(); }
+
+    // The counter is only written by its owning thread, a relaxed load/store pair avoids a locked instruction
+    template<typename T>
+    inline void Accumulate(std::atomic<T> &counter, T value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    // Log-linear latency histogram over raw ticks: exact below 8 ticks, then 8 linear sub-buckets per power of two,
+    // so a bucket is at most 12.5% wide. Durations beyond 2^41 ticks are clamped into the last bucket.
+    struct Histogram {
+        static constexpr int kSubBits = 3;
+        static constexpr int kMaxExponent = 40;
+        static constexpr std::size_t kBuckets = (kMaxExponent - kSubBits + 2) << kSubBits;
+
+        uint64_t counts_[kBuckets]{};
+        Tick_t min_{std::numeric_limits<Tick_t>::max()};
+        Tick_t max_{0};
+
+        static std::size_t getIndex(Tick_t ticks) {
+            if (ticks < (Tick_t{1} << kSubBits))
+                return ticks < 0 ? 0 : static_cast<std::size_t>(ticks);
+            const int exponent = 63 - __builtin_clzll(static_cast<unsigned long long>(ticks));
+            if (exponent > kMaxExponent)
+                return kBuckets - 1;
+            const std::size_t sub = (ticks >> (exponent - kSubBits)) & ((1 << kSubBits) - 1);
+            return (static_cast<std::size_t>(exponent - kSubBits + 1) << kSubBits) + sub;
+        }
+
+        static Tick_t getLowerBound(std::size_t index) {
+            if (index < (std::size_t{1} << kSubBits))
+                return static_cast<Tick_t>(index);
+            const int exponent = static_cast<int>(index >> kSubBits) + kSubBits - 1;
+            const Tick_t sub = static_cast<Tick_t>(index & ((1 << kSubBits) - 1));
+            return (Tick_t{1} << exponent) + (sub << (exponent - kSubBits));
+        }
+
+        static Tick_t getUpperBound(std::size_t index) {
+            return index + 1 < kBuckets ? getLowerBound(index + 1) - 1 : std::numeric_limits<Tick_t>::max();
+        }
+
+        uint64_t getCount() const {
+            uint64_t count = 0;
+            for (const auto bucket: counts_)
+                count += bucket;
+            return count;
+        }
+
+        void Merge(const Histogram &histogram) {
+            for (std::size_t index = 0; index < kBuckets; ++index)
+                counts_[index] += histogram.counts_[index];
+            min_ = std::min(min_, histogram.min_);
+            max_ = std::max(max_, histogram.max_);
+        }
+
+        // midpoint of the bucket holding the given quantile, clamped to the exact extremes
+        Tick_t getPercentile(long double quantile) const {
+            const uint64_t count = getCount();
+            if (count == 0)
+                return 0;
+            const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * count)));
+            uint64_t seen = 0;
+            for (std::size_t index = 0; index < kBuckets; ++index) {
+                seen += counts_[index];
+                if (seen >= rank) {
+                    const Tick_t lower = getLowerBound(index);
+                    const Tick_t middle = lower + (std::min(getUpperBound(index), max_) - lower) / 2;
+                    return std::max(min_, std::min(max_, middle));
+                }
+            }
+            return max_;
+        }
+    };
+
+    // Histogram updated by its owning thread only, allocated the first time a node is stopped on that thread
+    struct ThreadHistogram {
+        std::atomic<uint64_t> counts_[Histogram::kBuckets];
+        std::atomic<Tick_t> min_;
+        std::atomic<Tick_t> max_;
+        // counts at the last Reset, only accessed under RelationTree::mutex_
+        std::unique_ptr<Histogram> base_;
+
+        ThreadHistogram();
+
+        void Record(Tick_t ticks, uint64_t weight) {
+            Accumulate(counts_[Histogram::getIndex(ticks)], weight);
+            if (ticks < min_.load(std::memory_order_relaxed))
+                min_.store(ticks, std::memory_order_relaxed);
+            if (ticks > max_.load(std::memory_order_relaxed))
+                max_.store(ticks, std::memory_order_relaxed);
+        }
+
+        // adds what was recorded since the last Reset, extremes recorded before a Reset are replaced by the bounds
+        // of the outermost non-empty buckets
+        void Collect(Histogram &histogram) const;
+
+        void Reset();
+    };
+
+    // Thread CPU time and context switches under Timer::SetCpuTime(true), read when a period of activity of a node
+    // opens and closes on a thread. Both readings are system calls, taken before the clock at the start and after it
+    // at the stop so that they stay out of the recorded durations.
+    struct CpuClock {
+        CpuClock() = delete;
+
+        enum Kind_t { cpu, voluntary, involuntary, kinds };
+
+        static std::atomic<bool> enabled_;
+
+        // CPU time in nanoseconds and the switch counts of the calling thread
+        static void Read(int64_t (&reading)[kinds]) {
+            timespec time_spec{};
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time_spec);
+            rusage usage{};
+            getrusage(RUSAGE_THREAD, &usage);
+            reading[cpu] = static_cast<int64_t>(time_spec.tv_sec) * 1000000000 + time_spec.tv_nsec;
+            reading[voluntary] = usage.ru_nvcsw;
+            reading[involuntary] = usage.ru_nivcsw;
+        }
+
+        // nanoseconds of CPU time in clock ticks, to compare with the recorded durations
+        static Tick_t getTicks(int64_t nanoseconds) {
+            static const long double ticks_per_ns = Clock_t::getTicksPerSecond() / 1e9L;
+            return static_cast<Tick_t>(nanoseconds * ticks_per_ns);
+        }
+    };
+
+    std::atomic<bool> CpuClock::enabled_{false};
+
+    // Counters of the calling thread from perf_event_open under Timer::SetPerfCounters(true), read like the CPU time.
+    // Each thread opens one group the first time it needs it and reads all of its counters with a single read().
+    // Without a hardware PMU, e.g., in most virtual machines, software events are counted instead.
+    struct PerfCounters {
+        PerfCounters() = delete;
+
+        static constexpr int kEvents = 4;
+
+        // unknown until a group is opened, every thread then counts the events of the first group opened
+        enum Source_t { unknown, hardware, software, unavailable };
+
+        // index of the events of each source in a reading
+        enum Event_t { cycles = 0, instructions = 1, cache_misses = 2, branch_misses = 3, task_clock = 0, page_faults = 1 };
+
+        static std::atomic<bool> enabled_;
+        static std::atomic<int> source_;
+
+        // task-clock is in nanoseconds
+        static int getEventCount(int source) { return source == hardware ? 4 : 2; }
+
+        // opens the group of the calling thread into fds, returns the source of its events
+        static int Open(int (&fds)[kEvents]) {
+            const int source = source_.load(std::memory_order_relaxed);
+            int opened = unavailable;
+            if ((source == unknown || source == hardware) && OpenGroup(hardware, fds))
+                opened = hardware;
+            else if ((source == unknown || source == software) && OpenGroup(software, fds))
+                opened = software;
+            if (opened == unavailable)
+                return unavailable;
+            int expected = unknown;
+            if (!source_.compare_exchange_strong(expected, opened) && expected != opened) {
+                // another thread settled on the other source meanwhile
+                Close(fds);
+                return unavailable;
+            }
+            return opened;
+        }
+
+        static bool OpenGroup(int source, int (&fds)[kEvents]) {
+            static const std::pair<uint32_t, uint64_t> hardware_events[]{
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}};
+            static const std::pair<uint32_t, uint64_t> software_events[]{
+                    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}, {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}};
+            const std::pair<uint32_t, uint64_t> *events = source == hardware ? hardware_events : software_events;
+            for (int index = 0; index < getEventCount(source); ++index) {
+                perf_event_attr attr{};
+                attr.size = sizeof(attr);
+                attr.type = events[index].first;
+                attr.config = events[index].second;
+                // user space only, allowed up to perf_event_paranoid 2
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP;
+                fds[index] = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1,
+                                                        index == 0 ? -1 : fds[0], PERF_FLAG_FD_CLOEXEC));
+                if (fds[index] == -1) {
+                    Close(fds);
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static void Close(int (&fds)[kEvents]) {
+            for (auto &fd: fds) {
+                if (fd != -1)
+                    ::close(fd);
+                fd = -1;
+            }
+        }
+
+        static bool Read(const int (&fds)[kEvents], int source, int64_t (&reading)[kEvents]) {
+            const int count = getEventCount(source);
+            uint64_t buffer[1 + kEvents];
+            const ssize_t size = ::read(fds[0], buffer, sizeof(buffer));
+            if (size != static_cast<ssize_t>((1 + count) * sizeof(uint64_t)) || buffer[0] != static_cast<uint64_t>(count))
+                return false;
+            for (int index = 0; index < kEvents; ++index)
+                reading[index] = index < count ? static_cast<int64_t>(buffer[1 + index]) : 0;
+            return true;
+        }
+    };
+
+    std::atomic<bool> PerfCounters::enabled_{false};
+    std::atomic<int> PerfCounters::source_{PerfCounters::unknown};
+
+    // Readings of Kinds values accumulated per node of a chunk over its periods of activity, allocated the first time
+    // one of its nodes is recorded in the mode that takes them
+    template<int Kinds>
+    struct Usage {
+        // owning thread: the reading at the start of the current period of activity, open_ is false without one,
+        // and the calls stopped during it
+        int64_t start_[kChunkSize][Kinds];
+        bool open_[kChunkSize];
+        int64_t pending_calls_[kChunkSize];
+        // weighted like the calls
+        std::atomic<int64_t> values_[kChunkSize][Kinds];
+        // calls and total of the measured periods, the values only describe that part of the node
+        std::atomic<int64_t> calls_[kChunkSize];
+        std::atomic<Tick_t> ticks_[kChunkSize];
+        // value at the last Reset, written by the resetting thread
+        std::atomic<int64_t> base_[kChunkSize][Kinds];
+        std::atomic<int64_t> base_calls_[kChunkSize];
+        std::atomic<Tick_t> base_ticks_[kChunkSize];
+
+        void Open(std::size_t slot, const int64_t (&reading)[Kinds]) {
+            std::copy(reading, reading + Kinds, start_[slot]);
+            open_[slot] = true;
+            pending_calls_[slot] = 0;
+        }
+
+        // an invocation of the node stopped
+        void Count(std::size_t slot, uint32_t weight) {
+            if (open_[slot])
+                pending_calls_[slot] += weight;
+        }
+
+        void Close(std::size_t slot, const int64_t (&reading)[Kinds], uint32_t weight, Tick_t period) {
+            for (int kind = 0; kind < Kinds; ++kind)
+                Accumulate(values_[slot][kind], (reading[kind] - start_[slot][kind]) * weight);
+            Accumulate(calls_[slot], pending_calls_[slot]);
+            Accumulate(ticks_[slot], period);
+            open_[slot] = false;
+        }
+
+        // caller holds RelationTree::mutex_
+        void Collect(std::size_t slot, std::size_t id, std::vector<int64_t> (&values)[Kinds],
+                     std::vector<int64_t> &calls, std::vector<Tick_t> &ticks) const {
+            for (int kind = 0; kind < Kinds; ++kind)
+                values[kind][id] += values_[slot][kind].load(std::memory_order_relaxed) -
+                                    base_[slot][kind].load(std::memory_order_relaxed);
+            calls[id] += calls_[slot].load(std::memory_order_relaxed) - base_calls_[slot].load(std::memory_order_relaxed);
+            ticks[id] += ticks_[slot].load(std::memory_order_relaxed) - base_ticks_[slot].load(std::memory_order_relaxed);
+        }
+
+        // caller holds RelationTree::mutex_
+        void Reset(std::size_t slot) {
+            for (int kind = 0; kind < Kinds; ++kind)
+                base_[slot][kind].store(values_[slot][kind].load(std::memory_order_relaxed),
+                                        std::memory_order_relaxed);
+            base_calls_[slot].store(calls_[slot].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            base_ticks_[slot].store(ticks_[slot].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    };
+
+    typedef Usage<CpuClock::kinds> CpuUsage;
+    typedef Usage<PerfCounters::kEvents> PerfUsage;
+
+    // Heap usage under Timer::SetAllocationTracking(true), reported by TimerNew.cpp or the TimerMalloc library through
+    // the hooks of TimerAlloc.h
+    struct AllocCounter {
+        AllocCounter() = delete;
+
+        enum Kind_t { allocations, bytes, peak, kinds };
+
+        static std::atomic<bool> enabled_;
+        // set when TimerNew.cpp or the TimerMalloc library is loaded
+        static std::atomic<bool> installed_;
+    };
+
+    std::atomic<bool> AllocCounter::enabled_{false};
+    std::atomic<bool> AllocCounter::installed_{false};
+
+    // Heap usage of the nodes of a chunk, allocated the first time one of them is recorded under
+    // SetAllocationTracking(true). Allocations and bytes are charged to the innermost active node, the peak is the
+    // highest growth of the live bytes of the thread during one period of activity of the node, children included.
+    struct AllocUsage {
+        // owning thread: live bytes of the thread when the current period of activity opened, the high-water mark
+        // of the enclosing periods at that time, and the calls stopped during it, open_ is false without a period
+        int64_t start_live_[kChunkSize];
+        int64_t enclosing_high_[kChunkSize];
+        bool open_[kChunkSize];
+        int64_t pending_calls_[kChunkSize];
+        std::atomic<int64_t> values_[kChunkSize][AllocCounter::kinds];
+        // calls of the tracked periods, the values only describe that part of the node
+        std::atomic<int64_t> calls_[kChunkSize];
+        // allocations, bytes and calls at the last Reset, which clears the peak
+        std::atomic<int64_t> base_[kChunkSize][AllocCounter::kinds];
+        std::atomic<int64_t> base_calls_[kChunkSize];
+
+        // high is the high-water mark of the live bytes of the thread, restarted for the new period
+        void Open(std::size_t slot, int64_t live, int64_t &high) {
+            start_live_[slot] = live;
+            enclosing_high_[slot] = high;
+            high = live;
+            open_[slot] = true;
+            pending_calls_[slot] = 0;
+        }
+
+        // an invocation of the node stopped
+        void Count(std::size_t slot, uint32_t weight) {
+            if (open_[slot])
+                pending_calls_[slot] += weight;
+        }
+
+        void Close(std::size_t slot, int64_t &high) {
+            const int64_t growth = high - start_live_[slot];
+            // the only update of the owning thread that races with another thread, a Reset
+            int64_t peak = values_[slot][AllocCounter::peak].load(std::memory_order_relaxed);
+            while (growth > peak &&
+                   !values_[slot][AllocCounter::peak].compare_exchange_weak(peak, growth, std::memory_order_relaxed)) {}
+            high = std::max(high, enclosing_high_[slot]);
+            Accumulate(calls_[slot], pending_calls_[slot]);
+            open_[slot] = false;
+        }
+
+        // only while a period of the node is tracked, like its calls
+        void Charge(std::size_t slot, int64_t size) {
+            if (!open_[slot])
+                return;
+            Accumulate(values_[slot][AllocCounter::allocations], int64_t{1});
+            Accumulate(values_[slot][AllocCounter::bytes], size);
+        }
+
+        // caller holds RelationTree::mutex_
+        void Collect(std::size_t slot, std::size_t id, std::vector<int64_t> (&values)[AllocCounter::kinds],
+                     std::vector<int64_t> &calls) const {
+            for (int kind = AllocCounter::allocations; kind <= AllocCounter::bytes; ++kind)
+                values[kind][id] += values_[slot][kind].load(std::memory_order_relaxed) -
+                                    base_[slot][kind].load(std::memory_order_relaxed);
+            calls[id] += calls_[slot].load(std::memory_order_relaxed) - base_calls_[slot].load(std::memory_order_relaxed);
+            values[AllocCounter::peak][id] = std::max(values[AllocCounter::peak][id],
+                                                      values_[slot][AllocCounter::peak].load(std::memory_order_relaxed));
+        }
+
+        // caller holds RelationTree::mutex_
+        void Reset(std::size_t slot) {
+            for (int kind = AllocCounter::allocations; kind <= AllocCounter::bytes; ++kind)
+                base_[slot][kind].store(values_[slot][kind].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            base_calls_[slot].store(calls_[slot].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            values_[slot][AllocCounter::peak].store(0, std::memory_order_relaxed);
+        }
+    };
+
+    // Counters of every node merged from a set of threads, indexed by RelationNode::id_
+    struct Counters {
+        std::vector<int64_t> calls_{};
+        std::vector<Tick_t> ticks_{};
+        // nullptr when the node was never stopped
+        std::vector<std::unique_ptr<Histogram>> histograms_{};
+        // CPU time in nanoseconds and switch counts, over cpu_calls_ calls recording cpu_ticks_, both 0 when no thread
+        // measured the node
+        std::vector<int64_t> cpu_[CpuClock::kinds]{};
+        std::vector<int64_t> cpu_calls_{};
+        std::vector<Tick_t> cpu_ticks_{};
+        // perf events of PerfCounters::source_, over events_calls_ calls recording events_ticks_
+        std::vector<int64_t> events_[PerfCounters::kEvents]{};
+        std::vector<int64_t> events_calls_{};
+        std::vector<Tick_t> events_ticks_{};
+        // allocations, bytes and peak live bytes over heap_calls_ calls
+        std::vector<int64_t> heap_[AllocCounter::kinds]{};
+        std::vector<int64_t> heap_calls_{};
+
+        void Resize(std::size_t size);
+
+        void Merge(const Counters &counters);
+
+        Histogram &getHistogram(std::size_t id);
+    };
+
+    // Single producer single consumer ring of trace events, filled by its owning thread and drained by the flusher.
+    // A full ring drops the event instead of blocking the recording thread.
+    struct TraceRing {
+        explicit TraceRing(std::size_t capacity);
+
+        const uint64_t mask_;
+        const std::unique_ptr<TimerTrace::Event[]> events_;
+        // owning thread
+        std::atomic<uint64_t> head_{0};
+        std::atomic<uint64_t> dropped_{0};
+        uint64_t cached_tail_{0};
+        // keeps the flusher's cursor off the owner's cache line
+        char padding_[64]{};
+        // flusher, under RelationTree::mutex_
+        std::atomic<uint64_t> tail_{0};
+        uint64_t dropped_flushed_{0};
+
+        void Push(Tick_t ticks, uint32_t id, uint32_t thread) {
+            const uint64_t head = head_.load(std::memory_order_relaxed);
+            if (head - cached_tail_ > mask_) {
+                cached_tail_ = tail_.load(std::memory_order_acquire);
+                if (head - cached_tail_ > mask_) {
+                    Accumulate(dropped_, uint64_t{1});
+                    return;
+                }
+            }
+            events_[head & mask_] = TimerTrace::Event{ticks, id, thread};
+            head_.store(head + 1, std::memory_order_release);
+        }
+    };
+
+    struct ExemplarBuffer;
+
+    // Recording state of one thread, a structure of arrays indexed by RelationNode::id_ and split into chunks that
+    // never move. Durations are kept in raw clock ticks, conversion to the node time unit only happens when reporting.
+    // Only the owning thread writes the counters, reporters read them with relaxed loads under RelationTree::mutex_.
+    struct ThreadTable {
+        // marks the allocations and frees of the thread during its scope as the library's own, the hooks of
+        // TimerAlloc.h leave them out of the heap usage of the recorders
+        struct Internal {
+            Internal() : outer_(internal_) { internal_ = true; }
+
+            ~Internal() { internal_ = outer_; }
+
+            Internal(const Internal &) = delete;
+
+            Internal &operator=(const Internal &) = delete;
+
+        private:
+            const bool outer_;
+        };
+
+        struct Chunk {
+            // private to the owning thread: the number of invocations of the node open on the thread, and the start
+            // of the period during which there has been at least one
+            uint32_t active_[kChunkSize];
+            Tick_t start_[kChunkSize];
+            std::atomic<int64_t> calls_[kChunkSize];
+            std::atomic<Tick_t> ticks_[kChunkSize];
+            // odd while the owning thread updates calls_ and ticks_, so that readers see both from the same recording
+            std::atomic<uint32_t> sequence_[kChunkSize];
+            // value of the counters at the last Reset, written by the resetting thread
+            std::atomic<int64_t> base_calls_[kChunkSize];
+            std::atomic<Tick_t> base_ticks_[kChunkSize];
+            std::atomic<ThreadHistogram *> histograms_[kChunkSize];
+            // sampling state, owning thread only: invocations left until the next recorded one, the period they
+            // belong to, and the number of invocations the current period of activity stands for, 0 when the
+            // invocation that opened it is skipped
+            uint32_t countdown_[kChunkSize];
+            uint32_t period_[kChunkSize];
+            uint32_t weight_[kChunkSize];
+            // nullptr until the chunk is recorded under SetCpuTime(true), SetPerfCounters(true) or
+            // SetAllocationTracking(true)
+            std::atomic<CpuUsage *> cpu_usage_;
+            std::atomic<PerfUsage *> perf_usage_;
+            std::atomic<AllocUsage *> alloc_usage_;
+
+            // calls and ticks of the slot, retried while the owning thread is in the middle of an update
+            std::pair<int64_t, Tick_t> Read(std::size_t slot) const {
+                for (;;) {
+                    const uint32_t sequence = sequence_[slot].load(std::memory_order_acquire);
+                    const int64_t calls = calls_[slot].load(std::memory_order_relaxed);
+                    const Tick_t ticks = ticks_[slot].load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if ((sequence & 1) == 0 && sequence_[slot].load(std::memory_order_relaxed) == sequence)
+                        return {calls, ticks};
+                }
+            }
+
+            ~Chunk() {
+                for (auto &histogram: histograms_)
+                    delete histogram.load(std::memory_order_relaxed);
+                delete cpu_usage_.load(std::memory_order_relaxed);
+                delete perf_usage_.load(std::memory_order_relaxed);
+                delete alloc_usage_.load(std::memory_order_relaxed);
+            }
+
+            // owning thread only
+            template<typename Usage_t>
+            static Usage_t &getUsage(std::atomic<Usage_t *> &pointer) {
+                Usage_t *usage = pointer.load(std::memory_order_relaxed);
+                if (usage == nullptr) {
+                    const Internal internal;
+                    // value-initialized like the chunk
+                    usage = new Usage_t();
+                    pointer.store(usage, std::memory_order_release);
+                }
+                return *usage;
+            }
+
+            // ends an invocation without recording it
+            void Drop(std::size_t slot) {
+                if (--active_[slot] != 0)
+                    return;
+                CpuUsage *cpu_usage = cpu_usage_.load(std::memory_order_relaxed);
+                if (cpu_usage != nullptr)
+                    cpu_usage->open_[slot] = false;
+                PerfUsage *perf_usage = perf_usage_.load(std::memory_order_relaxed);
+                if (perf_usage != nullptr)
+                    perf_usage->open_[slot] = false;
+                AllocUsage *alloc_usage = alloc_usage_.load(std::memory_order_relaxed);
+                if (alloc_usage != nullptr)
+                    alloc_usage->open_[slot] = false;
+            }
+
+            // owning thread only
+            ThreadHistogram &getHistogram(std::size_t slot) {
+                ThreadHistogram *histogram = histograms_[slot].load(std::memory_order_relaxed);
+#if __cplusplus > 201703L
+                [[unlikely]]
+#endif
+                if (histogram == nullptr) {
+                    const Internal internal;
+                    histogram = new ThreadHistogram{};
+                    histograms_[slot].store(histogram, std::memory_order_release);
+                }
+                return *histogram;
+            }
+        };
+
+        explicit ThreadTable(std::size_t index);
+
+        ~ThreadTable();
+
+        ThreadTable(const ThreadTable &) = delete;
+
+        ThreadTable &operator=(const ThreadTable &) = delete;
+
+        // an invocation in progress on this thread
+        struct Frame {
+            uint32_t id_;
+            // kNoNode when started through a handle bound to a node
+            uint32_t name_id_;
+            // identifies the invocation in a Timer::Token, never 0
+            uint32_t serial_;
+            // number of invocations it stands for, 0 when it is skipped by sampling
+            uint32_t weight_;
+            Tick_t start_;
+        };
+
+        static constexpr std::size_t kMaxDepth = 256;
+        // serial of the tokens of recorders skipped by Overflow, never given to a frame
+        static constexpr uint32_t kOverflowSerial = std::numeric_limits<uint32_t>::max();
+
+        const std::size_t index_;
+        std::atomic<Chunk *> chunks_[kMaxChunks];
+        // given by the tracer while it runs, owned by Tracer::rings_
+        std::atomic<TraceRing *> trace_{nullptr};
+        // allocated the first time the thread starts a node under SetExemplars
+        std::atomic<ExemplarBuffer *> exemplars_{nullptr};
+        // active scopes, owning thread only
+        Frame stack_[kMaxDepth];
+        std::size_t depth_{0};
+        // recorders started beyond kMaxDepth and not stopped yet, they are not recorded, innermost last.
+        // Consecutive starts through the same handle or name share an entry. Owning thread only.
+        struct Skipped {
+            uint32_t id_;
+            bool floating_;
+            uint32_t count_;
+        };
+        std::vector<Skipped> overflow_;
+        // recorders ever started beyond kMaxDepth on any thread
+        static std::atomic<uint64_t> overflow_count_global_;
+        uint32_t serial_{0};
+        // perf_event_open group of the thread, opened the first time it is read, owning thread only
+        int perf_fds_[PerfCounters::kEvents]{-1, -1, -1, -1};
+        int perf_source_{PerfCounters::unknown};
+        // bytes allocated minus bytes freed by the thread under SetAllocationTracking(true), and their high-water mark
+        // since the innermost period of activity opened, owning thread only
+        int64_t live_bytes_{0};
+        int64_t high_bytes_{0};
+        // value of switch_epoch_global_ when the stack was last trusted, owning thread only
+        uint32_t switch_epoch_{0};
+
+        bool ReadEvents(int64_t (&reading)[PerfCounters::kEvents]) {
+            if (perf_source_ == PerfCounters::unknown)
+                perf_source_ = PerfCounters::Open(perf_fds_);
+            return perf_source_ != PerfCounters::unavailable && PerfCounters::Read(perf_fds_, perf_source_, reading);
+        }
+
+        uint32_t getActiveId() const { return depth_ == 0 ? 0 : stack_[depth_ - 1].id_; }
+
+        // caller checks the stack is not full
+        Frame &Push(uint32_t id, uint32_t name_id, uint32_t weight) {
+            if (++serial_ == kOverflowSerial)
+                serial_ = 1;
+            return stack_[depth_++] = Frame{id, name_id, serial_, weight, 0};
+        }
+
+        // removes the innermost frame of the node into frame, recorders may be stopped out of order.
+        // Returns false when the node has no frame.
+        bool Pop(uint32_t id, Frame &frame) {
+            for (std::size_t depth = depth_; depth-- > 0;) {
+                if (stack_[depth].id_ == id) {
+                    Remove(depth, frame);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // removes the frame of the invocation into frame, false when it is not open on this thread
+        bool Pop(uint32_t id, uint32_t serial, Frame &frame) {
+            for (std::size_t depth = depth_; depth-- > 0;) {
+                if (stack_[depth].serial_ == serial) {
+                    if (stack_[depth].id_ != id)
+                        return false;
+                    Remove(depth, frame);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void Remove(std::size_t depth, Frame &frame) {
+            frame = stack_[depth];
+            std::copy(stack_ + depth + 1, stack_ + depth_, stack_ + depth);
+            --depth_;
+        }
+
+        // Frames opened before the runtime switch was turned off are never closed, they are dropped by the first
+        // Start or Stop after it is turned on again
+        void CheckSwitch() {
+            const uint32_t switch_epoch = switch_epoch_global_.load(std::memory_order_relaxed);
+            if (switch_epoch != switch_epoch_) {
+                for (std::size_t depth = 0; depth < depth_; ++depth)
+                    getChunk(stack_[depth].id_).Drop(stack_[depth].id_ & (kChunkSize - 1));
+                depth_ = 0;
+                overflow_.clear();
+                DropCaptures();
+                switch_epoch_ = switch_epoch;
+            }
+        }
+
+        // the open exemplar captures of the dropped frames
+        void DropCaptures();
+
+        // A recorder started on a full stack is counted and skipped, the Stop of its token, or the next Stop through
+        // the same handle or name while it is the innermost skipped one, closes it without recording.
+        // Returns true when the Start is skipped.
+        bool Overflow(uint32_t id, bool floating) {
+            if (depth_ != kMaxDepth)
+                return false;
+            if (!overflow_.empty() && overflow_.back().id_ == id && overflow_.back().floating_ == floating) {
+                ++overflow_.back().count_;
+            } else {
+                const Internal internal;
+                overflow_.push_back(Skipped{id, floating, 1});
+            }
+            overflow_count_global_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        // true when a Stop through the handle closes the innermost recorder skipped by Overflow
+        bool Overflowed(uint32_t id, bool floating) {
+            if (overflow_.empty() || overflow_.back().id_ != id || overflow_.back().floating_ != floating)
+                return false;
+            if (--overflow_.back().count_ == 0)
+                overflow_.pop_back();
+            return true;
+        }
+
+        // closes the innermost recorder of the token's id skipped by Overflow, the tokens may stop in any order
+        void Overflowed(uint32_t id) {
+            for (auto skipped = overflow_.rbegin(); skipped != overflow_.rend(); ++skipped) {
+                if (skipped->id_ == id) {
+                    if (--skipped->count_ == 0)
+                        overflow_.erase(std::next(skipped).base());
+                    return;
+                }
+            }
+        }
+
+        // A Stop without a frame may pair with a Start skipped while the runtime switch was off, or dropped by
+        // CheckSwitch, only when it straddles a switch: the thread has seen the switch turned on, and no frame is open,
+        // since every frame open now was started after the switch and would be nested in such a Start
+        bool isStraddling() const { return switch_epoch_ != 0 && depth_ == 0; }
+
+        // removes the innermost frame carrying the name into frame, false when there is none
+        bool PopName(uint32_t name_id, Frame &frame);
+
+        // owning thread only
+        Chunk &getChunk(std::size_t id) {
+            Chunk *chunk = chunks_[id >> kChunkBits].load(std::memory_order_relaxed);
+#if __cplusplus > 201703L
+            [[unlikely]]
+#endif
+            if (chunk == nullptr)
+                chunk = Grow(id);
+            return *chunk;
+        }
+
+        Chunk *Grow(std::size_t id);
+
+        const Chunk *findChunk(std::size_t id) const {
+            return chunks_[id >> kChunkBits].load(std::memory_order_acquire);
+        }
+
+        // adds the counters recorded since the last Reset, the histograms only when asked,
+        // caller holds RelationTree::mutex_
+        void Collect(Counters &counters, bool histograms = true) const;
+
+        // caller holds RelationTree::mutex_
+        void Reset(std::size_t id);
+
+        static ThreadTable &Local() {
+            ThreadTable *table = local_;
+#if __cplusplus > 201703L
+            [[unlikely]]
+#endif
+            if (table == nullptr)
+                table = Attach();
+            return *table;
+        }
+
+        static ThreadTable *Attach();
+
+        static void Detach();
+
+        static thread_local ThreadTable *local_;
+        // set within an Internal scope
+        static thread_local bool internal_;
+        // live threads and the merged counters of exited threads, guarded by RelationTree::mutex_
+        static std::vector<ThreadTable *> threads_;
+        static Counters retired_;
+        static std::size_t thread_count_;
+        // incremented whenever the runtime switch is turned on
+        static std::atomic<uint32_t> switch_epoch_global_;
+    };
+
+    // Streams the trace rings of all threads into a memory-mapped file, see TimerTrace.h for the layout.
+    // The file is guarded by mutex_, held by the flusher while it writes, and the rings by registry_, which is never
+    // held while waiting for mutex_. Threads attach and exit under RelationTree::mutex_ and registry_ only,
+    // so that writing the file never blocks the tree. Lock order: RelationTree::mutex_, mutex_, registry_.
+    struct Tracer {
+        Tracer() = delete;
+
+        static std::atomic<bool> enabled_;
+        static std::mutex mutex_;
+        static std::mutex registry_;
+        // Every ring ever handed to a thread, never freed before exit since a thread may still push into a ring it
+        // was given for an earlier trace. Rings of exited threads are reused by new threads once drained.
+        static std::vector<std::unique_ptr<TraceRing>> rings_;
+        // empty rings, and the rings of exited threads not drained yet
+        static std::vector<TraceRing *> free_rings_;
+        static std::vector<TraceRing *> taken_rings_;
+        // rings are given to attaching threads while a trace is open
+        static bool giving_;
+        static std::size_t ring_capacity_;
+        static int fd_;
+        static char *map_;
+        static std::size_t mapped_;
+        static std::size_t size_;
+        static uint64_t event_count_;
+        static uint64_t dropped_count_;
+        static std::thread flusher_;
+        static std::condition_variable wake_;
+        static bool stopping_;
+        // the rings being drained, copied from rings_ and taken_rings_ under registry_, guarded by mutex_
+        static std::vector<TraceRing *> draining_;
+        static std::vector<TraceRing *> drained_;
+
+        static void Record(ThreadTable &table, std::size_t id, Tick_t ticks, bool end) {
+            // rings are given out before tracing is enabled, only a thread racing with StartTracing may lack one
+            TraceRing *ring = table.trace_.load(std::memory_order_relaxed);
+            if (ring != nullptr && id != RelationTree::calibration_id_.load(std::memory_order_relaxed))
+                ring->Push(ticks, static_cast<uint32_t>(id) | (end ? TimerTrace::kEndFlag : 0),
+                           static_cast<uint32_t>(table.index_));
+        }
+
+        // gives the thread an empty ring of ring_capacity_, caller holds registry_
+        static void Give(ThreadTable &table);
+
+        // keeps the ring of an exiting thread to be drained by the flusher then reused, caller holds registry_
+        static void Take(ThreadTable &table) noexcept;
+
+        static void Open(const std::string &path);
+
+        // writes the name table, serialized by WriteNames, and the header
+        static void Close(const std::string &names, uint64_t name_count);
+
+        static void Write(const void *data, std::size_t size);
+
+        static void Drain(TraceRing &ring);
+
+        // drains every ring, and makes the rings of exited threads reusable, caller holds mutex_
+        static void DrainAll();
+
+        static void Flush();
+    };
+
+    // Detaches the table of a thread when it exits
+    struct ThreadGuard {
+        ~ThreadGuard() { ThreadTable::Detach(); }
+    };
+
+    thread_local ThreadGuard thread_guard_{};
+
+    // Records one in N invocations of a node, counted per thread. A recorded invocation stands for the N - 1 skipped
+    // before it, its duration and call are added N times so that the reports need no scaling.
+    struct Sampler {
+        Sampler() = delete;
+
+        static constexpr uint32_t kMaxPeriod = 1u << 16;
+
+        // a node has a period above 1 or the rate is adaptive, otherwise every invocation is recorded
+        static std::atomic<bool> active_;
+        // calibrated pair overhead divided by the budget, in ticks, 0 when the rate is not adaptive
+        static std::atomic<double> cost_;
+
+        // owning thread only, returns the weight of the invocation, 0 when it is skipped
+        static uint32_t Sample(ThreadTable::Chunk &chunk, std::size_t slot, std::size_t id) {
+            uint32_t &countdown = chunk.countdown_[slot];
+            if (countdown > 1) {
+                --countdown;
+                return 0;
+            }
+            const uint32_t weight = std::max<uint32_t>(1, chunk.period_[slot]);
+            uint32_t period = RelationTree::node_info_.find(id)->period_.load(std::memory_order_relaxed);
+            if (period == 0)
+                return 1;
+            // the pair overhead of one recording per period stays under the budget of the period's duration
+            const double cost = cost_.load(std::memory_order_relaxed);
+            const int64_t calls = chunk.calls_[slot].load(std::memory_order_relaxed);
+            const Tick_t ticks = chunk.ticks_[slot].load(std::memory_order_relaxed);
+            if (cost > 0 && calls > 0) {
+                const double adaptive = std::ceil(cost * calls / std::max<Tick_t>(1, ticks));
+                period = std::max(period, static_cast<uint32_t>(std::min<double>(kMaxPeriod, adaptive)));
+            }
+            chunk.period_[slot] = countdown = period;
+            return weight;
+        }
+    };
+
+    std::atomic<bool> Sampler::active_{false};
+    std::atomic<double> Sampler::cost_{0};
+
+    // Slowest invocations of the nodes under SetExemplars, kept per thread with the invocations that stopped inside
+    // them. While a captured invocation is open, every invocation stopping on the thread appends a span to a buffer,
+    // consecutive ones of a node at the same depth merged into one. When the captured invocation stops, its spans
+    // are copied into a slot if it is among the slowest of its node, otherwise the buffer is only rewound.
+    struct ExemplarBuffer {
+        static constexpr std::size_t kSpans = 256;
+        static constexpr std::size_t kCaptures = 16;
+        static constexpr std::size_t kSlots = 16;
+        static constexpr std::size_t kSlotSpans = 64;
+
+        enum State_t : uint32_t { empty, ready, busy };
+
+        struct Span {
+            uint32_t id_;
+            // depth of the stack once the invocation stopped, relative to the captured invocation in a slot
+            uint32_t depth_;
+            int64_t calls_;
+            Tick_t start_;
+            Tick_t ticks_;
+        };
+
+        // an open captured invocation, with the size of the buffer and the count of dropped spans at its start
+        struct Capture {
+            uint32_t serial_;
+            uint32_t mark_;
+            uint64_t dropped_;
+        };
+
+        // Filled by the owning thread, copied or emptied by reporters. Whoever moves state_ to busy has the slot,
+        // the owning thread gives up the exemplar instead of waiting.
+        struct Slot {
+            std::atomic<uint32_t> state_;
+            uint32_t id_;
+            // exemplars of the node per thread when it was captured
+            uint32_t limit_;
+            uint32_t count_;
+            Tick_t start_;
+            Tick_t ticks_;
+            uint64_t dropped_;
+            Span spans_[kSlotSpans];
+        };
+
+        // a slot copied by a reporter, or left by an exited thread
+        struct Copy {
+            std::size_t thread_;
+            uint32_t id_;
+            uint32_t limit_;
+            Tick_t ticks_;
+            uint64_t dropped_;
+            std::vector<Span> spans_;
+        };
+
+        // owning thread only
+        Span spans_[kSpans];
+        std::size_t size_;
+        uint64_t dropped_;
+        Capture captures_[kCaptures];
+        std::size_t open_;
+        Slot slots_[kSlots];
+
+        // a node has exemplars, otherwise nothing is captured
+        static std::atomic<bool> active_;
+        // exemplars of exited threads, guarded by RelationTree::mutex_
+        static std::vector<Copy> retired_;
+
+        // owning thread, before the clock read of the start
+        static void Open(ThreadTable &table, uint32_t id, uint32_t serial) {
+            const NodeInfo *info = RelationTree::node_info_.find(id);
+            if (info == nullptr || info->exemplars_.load(std::memory_order_relaxed) == 0)
+                return;
+            ExemplarBuffer *buffer = table.exemplars_.load(std::memory_order_relaxed);
+            if (buffer == nullptr) {
+                const ThreadTable::Internal internal;
+                // value-initialized, every slot is empty
+                buffer = new ExemplarBuffer();
+                table.exemplars_.store(buffer, std::memory_order_release);
+            }
+            if (buffer->open_ == kCaptures)
+                return;
+            buffer->captures_[buffer->open_++] = Capture{serial, static_cast<uint32_t>(buffer->size_), buffer->dropped_};
+        }
+
+        // owning thread, for every recorded invocation stopping while a capture is open, depth is the one of the stack
+        // once it stopped
+        void Stop(uint32_t id, uint32_t serial, Tick_t start, Tick_t end, std::size_t depth);
+
+        void Append(uint32_t id, uint32_t depth, Tick_t start, Tick_t ticks);
+
+        void Keep(const Capture &capture, uint32_t id, Tick_t start, Tick_t ticks, std::size_t depth);
+
+        // drops the open captures, when the frames are dropped
+        void Abandon() {
+            open_ = 0;
+            size_ = 0;
+        }
+
+        // caller holds RelationTree::mutex_
+        void Collect(std::size_t thread, std::vector<Copy> &copies);
 
-            std::unordered_map<std::string, std::unique_ptr<RelationNode>> descendants_{};
-            const RelationNode *parent;
+        // empties the slots of the node, or every slot for kNoNode, caller holds RelationTree::mutex_
+        void Clear(uint32_t id);
 
-            explicit RelationNode(const RelationNode *father_ptr);
+        // keeps the slowest limit_ of each node, slowest first
+        static void Select(std::vector<Copy> &copies);
+    };
 
-            ~RelationNode();
+    std::atomic<bool> ExemplarBuffer::active_{false};
+    std::vector<ExemplarBuffer::Copy> ExemplarBuffer::retired_{};
+
+    // Per-thread memo of name lookups, so that the string API does not take RelationTree::mutex_ on every call
+    struct NameCache {
+        struct Entry {
+            Timer::Handle handle_;
+            std::size_t father_id_;
         };
 
-        static std::unordered_map<std::string, const RelationNode *> plain_nodes_;
-        const static std::unique_ptr<RelationNode> root_;
+        std::uint64_t epoch_{0};
+        std::unordered_map<std::string, Entry> entries_{};
 
-        static const RelationTree::RelationNode *getNodePtr(const std::string &name);
+        const Entry *find(const std::string &name);
+
+        static thread_local NameCache local_;
+        // bumped by Erase to invalidate every cache
+        static std::atomic<std::uint64_t> epoch_global_;
     };
 
-    std::unordered_map<const RelationTree::RelationNode *, std::chrono::time_point<std::chrono::system_clock>> start_time_{};
-    std::unordered_map<const RelationTree::RelationNode *, Timer::TimeUnit_t> time_unit_map_{};
+    std::mutex RelationTree::mutex_{};
+    std::atomic<bool> Tracer::enabled_{false};
+    std::mutex Tracer::mutex_{};
+    std::mutex Tracer::registry_{};
+    std::vector<std::unique_ptr<TraceRing>> Tracer::rings_{};
+    std::vector<TraceRing *> Tracer::free_rings_{};
+    std::vector<TraceRing *> Tracer::taken_rings_{};
+    bool Tracer::giving_{false};
+    std::size_t Tracer::ring_capacity_{0};
+    int Tracer::fd_{-1};
+    char *Tracer::map_{nullptr};
+    std::size_t Tracer::mapped_{0};
+    std::size_t Tracer::size_{0};
+    uint64_t Tracer::event_count_{0};
+    uint64_t Tracer::dropped_count_{0};
+    std::thread Tracer::flusher_{};
+    std::condition_variable Tracer::wake_{};
+    bool Tracer::stopping_{false};
+    std::vector<TraceRing *> Tracer::draining_{};
+    std::vector<TraceRing *> Tracer::drained_{};
+    thread_local ThreadTable *ThreadTable::local_{nullptr};
+    thread_local bool ThreadTable::internal_{false};
+    std::vector<ThreadTable *> ThreadTable::threads_{};
+    Counters ThreadTable::retired_{};
+    std::size_t ThreadTable::thread_count_{0};
+    std::atomic<uint32_t> ThreadTable::switch_epoch_global_{0};
+    std::atomic<uint64_t> ThreadTable::overflow_count_global_{0};
+    thread_local NameCache NameCache::local_{};
+    std::atomic<std::uint64_t> NameCache::epoch_global_{0};
     std::unordered_map<std::string, const RelationTree::RelationNode *> RelationTree::plain_nodes_{};
-    const std::unique_ptr<RelationTree::RelationNode> RelationTree::root_{new RelationNode{nullptr}};
+    std::unordered_map<std::string, uint32_t> RelationTree::name_ids_{};
+    std::vector<std::string> RelationTree::names_{};
+    std::vector<std::vector<const RelationTree::RelationNode *>> RelationTree::name_nodes_{};
+    std::vector<uint32_t> RelationTree::periods_{};
+    std::vector<std::pair<uint32_t, double>> RelationTree::exemplars_{};
+    std::vector<const RelationTree::RelationNode *> RelationTree::node_table_{};
+    StableArray<NodeInfo> RelationTree::node_info_{};
+    std::vector<std::unique_ptr<ChildTable>> RelationTree::retired_children_{};
+    std::atomic<bool> RelationTree::auto_parent_{false};
+    std::atomic<uint32_t> RelationTree::calibration_id_{kNoNode};
+    const std::unique_ptr<RelationTree::RelationNode> RelationTree::root_{
+            new RelationNode{nullptr, 0, RelationTree::ReserveNameId("root"), Timer::ms}};
 
     template<typename Iterator>
     inline void ExistChecker(const Iterator &find, const Iterator &end, const std::string &name) {
@@ -61,249 +1310,1391 @@ namespace {
             map.erase(find);
     }
 
-    RelationTree::RelationNode::RelationNode(const RelationTree::RelationNode *father_ptr) : parent(father_ptr) {}
+    RelationTree::RelationNode::RelationNode(const RelationTree::RelationNode *father_ptr, std::size_t id,
+                                             uint32_t name_id, Timer::TimeUnit_t time_unit)
+            : parent(father_ptr), id_(id), name_id_(name_id), time_unit_(time_unit) {
+        if (id_ >= node_table_.size())
+            node_table_.resize(id_ + 1, nullptr);
+        node_table_[id_] = this;
+        NodeInfo &info = node_info_.Ensure(id_);
+        info.name_id_ = name_id_;
+        info.time_unit_ = time_unit_;
+        info.period_.store(periods_[name_id_], std::memory_order_relaxed);
+        info.exemplars_.store(exemplars_[name_id_].first, std::memory_order_relaxed);
+        info.exemplar_threshold_.store(exemplars_[name_id_].second, std::memory_order_relaxed);
+        name_nodes_[name_id_].push_back(this);
+        if (parent == nullptr)
+            return;
+        NodeInfo &father_info = node_info_.Ensure(parent->id_);
+        ChildTable *children = father_info.children_.load(std::memory_order_relaxed);
+        if (children != nullptr && children->Insert(name_id_, static_cast<uint32_t>(id_)))
+            return;
+        // grow: copy the live entries into a table twice as large, readers switch over on the release store
+        std::unique_ptr<ChildTable> grown{new ChildTable{children == nullptr ? 4 : 2 * (children->mask_ + 1)}};
+        for (const auto &node: parent->descendants_)
+            if (node.second.get() != this)
+                grown->Insert(node.second->name_id_, static_cast<uint32_t>(node.second->id_));
+        grown->Insert(name_id_, static_cast<uint32_t>(id_));
+        father_info.children_.store(grown.release(), std::memory_order_release);
+        if (children != nullptr)
+            retired_children_.emplace_back(children);
+    }
 
     RelationTree::RelationNode::~RelationNode() {
-        for (const auto &node: descendants_) {
-            TryErase(start_time_, node.second.get());
-            TryErase(time_unit_map_, node.second.get());
-            TryErase(RelationTree::plain_nodes_, node.first);
+        auto find = plain_nodes_.find(names_[name_id_]);
+        if (find != plain_nodes_.end() && find->second == this)
+            plain_nodes_.erase(find);
+        auto &nodes = name_nodes_[name_id_];
+        nodes.erase(std::find(nodes.begin(), nodes.end(), this));
+        if (parent != nullptr) {
+            ChildTable *children = node_info_.find(parent->id_)->children_.load(std::memory_order_relaxed);
+            children->Insert(name_id_, kNoNode);
         }
+        // ids are never reused, whatever is still recorded through a stale handle is never reported
+        node_table_[id_] = nullptr;
     }
 
     const RelationTree::RelationNode *RelationTree::getNodePtr(const std::string &name) {
         auto find = plain_nodes_.find(name);
-        ExistChecker(find, plain_nodes_.end(), name);
-        return find->second;
+        if (find != plain_nodes_.end())
+            return find->second;
+        auto name_find = name_ids_.find(name);
+        if (name_find == name_ids_.end() || name_nodes_[name_find->second].empty())
+            throw std::runtime_error("name {" + name + "} not exist");
+        if (name_nodes_[name_find->second].size() > 1)
+            throw std::runtime_error("name {" + name + "} is ambiguous");
+        return name_nodes_[name_find->second].front();
+    }
+
+    std::string RelationTree::getPath(const RelationNode *node_ptr) {
+        std::string path = names_[node_ptr->name_id_];
+        for (auto father_ptr = node_ptr->parent; father_ptr != root_.get(); father_ptr = father_ptr->parent)
+            path = names_[father_ptr->name_id_] + '/' + path;
+        return path;
+    }
+
+    uint32_t RelationTree::getNameId(const std::string &name) {
+        auto find = name_ids_.find(name);
+        if (find != name_ids_.end())
+            return find->second;
+        const uint32_t name_id = ReserveNameId(name);
+        name_ids_.emplace(name, name_id);
+        return name_id;
+    }
+
+    uint32_t RelationTree::ReserveNameId(const std::string &name) {
+        const auto name_id = static_cast<uint32_t>(names_.size());
+        names_.push_back(name);
+        name_nodes_.emplace_back();
+        periods_.push_back(1);
+        exemplars_.emplace_back(0, 0);
+        return name_id;
+    }
+
+    const RelationTree::RelationNode *
+    RelationTree::Register(const std::string &name, const RelationNode *father_ptr, Timer::TimeUnit_t time_unit) {
+        auto find = plain_nodes_.find(name);
+        if (find != plain_nodes_.end()) {
+            if (find->second->parent != father_ptr)
+                throw std::runtime_error("name {" + name + "} duplicated");
+            return find->second;
+        }
+        const RelationNode *ret = getChild(father_ptr, getNameId(name), time_unit);
+        plain_nodes_.emplace(name, ret);
+        return ret;
+    }
+
+    const RelationTree::RelationNode *
+    RelationTree::getChild(const RelationNode *father_ptr, uint32_t name_id, Timer::TimeUnit_t time_unit) {
+        const std::string &name = names_[name_id];
+        auto find = father_ptr->descendants_.find(name);
+        if (find != father_ptr->descendants_.end())
+            return find->second.get();
+        if (node_table_.size() >= kChunkSize * kMaxChunks)
+            throw std::runtime_error("too many recorders to register {" + name + "}");
+        auto &descendants = const_cast<RelationNode *>(father_ptr)->descendants_;
+        std::unique_ptr<RelationNode> node_ptr{new RelationNode{father_ptr, node_table_.size(), name_id, time_unit}};
+        return descendants.emplace(name, std::move(node_ptr)).first->second.get();
+    }
+
+    ThreadHistogram::ThreadHistogram() {
+        for (auto &count: counts_)
+            count.store(0, std::memory_order_relaxed);
+        min_.store(std::numeric_limits<Tick_t>::max(), std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    void ThreadHistogram::Collect(Histogram &histogram) const {
+        std::size_t lowest = Histogram::kBuckets, highest = 0;
+        for (std::size_t index = 0; index < Histogram::kBuckets; ++index) {
+            uint64_t count = counts_[index].load(std::memory_order_relaxed);
+            if (base_)
+                count -= base_->counts_[index];
+            if (count == 0)
+                continue;
+            histogram.counts_[index] += count;
+            lowest = std::min(lowest, index);
+            highest = index;
+        }
+        if (lowest == Histogram::kBuckets)
+            return;
+        Tick_t min = min_.load(std::memory_order_relaxed), max = max_.load(std::memory_order_relaxed);
+        if (base_) {
+            min = std::max(min, Histogram::getLowerBound(lowest));
+            max = std::min(max, Histogram::getUpperBound(highest));
+        }
+        histogram.min_ = std::min(histogram.min_, min);
+        histogram.max_ = std::max(histogram.max_, max);
+    }
+
+    void ThreadHistogram::Reset() {
+        if (!base_)
+            base_.reset(new Histogram{});
+        for (std::size_t index = 0; index < Histogram::kBuckets; ++index)
+            base_->counts_[index] = counts_[index].load(std::memory_order_relaxed);
+    }
+
+    void Counters::Resize(std::size_t size) {
+        calls_.resize(size, 0);
+        ticks_.resize(size, 0);
+        histograms_.resize(size);
+        for (auto &values: cpu_)
+            values.resize(size, 0);
+        cpu_calls_.resize(size, 0);
+        cpu_ticks_.resize(size, 0);
+        for (auto &values: events_)
+            values.resize(size, 0);
+        events_calls_.resize(size, 0);
+        events_ticks_.resize(size, 0);
+        for (auto &values: heap_)
+            values.resize(size, 0);
+        heap_calls_.resize(size, 0);
+    }
+
+    void Counters::Merge(const Counters &counters) {
+        for (std::size_t id = 0; id < counters.calls_.size(); ++id) {
+            calls_[id] += counters.calls_[id];
+            ticks_[id] += counters.ticks_[id];
+            if (counters.histograms_[id])
+                getHistogram(id).Merge(*counters.histograms_[id]);
+            for (int kind = 0; kind < CpuClock::kinds; ++kind)
+                cpu_[kind][id] += counters.cpu_[kind][id];
+            cpu_calls_[id] += counters.cpu_calls_[id];
+            cpu_ticks_[id] += counters.cpu_ticks_[id];
+            for (int kind = 0; kind < PerfCounters::kEvents; ++kind)
+                events_[kind][id] += counters.events_[kind][id];
+            events_calls_[id] += counters.events_calls_[id];
+            events_ticks_[id] += counters.events_ticks_[id];
+            heap_[AllocCounter::allocations][id] += counters.heap_[AllocCounter::allocations][id];
+            heap_[AllocCounter::bytes][id] += counters.heap_[AllocCounter::bytes][id];
+            heap_[AllocCounter::peak][id] = std::max(heap_[AllocCounter::peak][id], counters.heap_[AllocCounter::peak][id]);
+            heap_calls_[id] += counters.heap_calls_[id];
+        }
+    }
+
+    Histogram &Counters::getHistogram(std::size_t id) {
+        if (!histograms_[id])
+            histograms_[id].reset(new Histogram{});
+        return *histograms_[id];
+    }
+
+    ThreadTable::ThreadTable(std::size_t index) : index_(index) {
+        for (auto &chunk: chunks_)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ThreadTable::~ThreadTable() {
+        for (auto &chunk: chunks_)
+            delete chunk.load(std::memory_order_relaxed);
+        delete exemplars_.load(std::memory_order_relaxed);
+        PerfCounters::Close(perf_fds_);
+    }
+
+    ThreadTable::Chunk *ThreadTable::Grow(std::size_t id) {
+        const Internal internal;
+        // value-initialized, every counter starts from 0
+        Chunk *chunk = new Chunk();
+        chunks_[id >> kChunkBits].store(chunk, std::memory_order_release);
+        return chunk;
+    }
+
+    void ThreadTable::Collect(Counters &counters, bool histograms) const {
+        for (std::size_t id = 0; id < counters.calls_.size(); ++id) {
+            const Chunk *chunk = findChunk(id);
+            if (chunk == nullptr) {
+                id |= kChunkSize - 1;
+                continue;
+            }
+            // erased nodes are never reported
+            if (RelationTree::node_table_[id] == nullptr)
+                continue;
+            const std::size_t slot = id & (kChunkSize - 1);
+            const std::pair<int64_t, Tick_t> recorded = chunk->Read(slot);
+            counters.calls_[id] += recorded.first - chunk->base_calls_[slot].load(std::memory_order_relaxed);
+            counters.ticks_[id] += recorded.second - chunk->base_ticks_[slot].load(std::memory_order_relaxed);
+            const ThreadHistogram *histogram =
+                    histograms ? chunk->histograms_[slot].load(std::memory_order_acquire) : nullptr;
+            if (histogram != nullptr)
+                histogram->Collect(counters.getHistogram(id));
+            const CpuUsage *cpu_usage = chunk->cpu_usage_.load(std::memory_order_acquire);
+            if (cpu_usage != nullptr)
+                cpu_usage->Collect(slot, id, counters.cpu_, counters.cpu_calls_, counters.cpu_ticks_);
+            const PerfUsage *perf_usage = chunk->perf_usage_.load(std::memory_order_acquire);
+            if (perf_usage != nullptr)
+                perf_usage->Collect(slot, id, counters.events_, counters.events_calls_, counters.events_ticks_);
+            const AllocUsage *alloc_usage = chunk->alloc_usage_.load(std::memory_order_acquire);
+            if (alloc_usage != nullptr)
+                alloc_usage->Collect(slot, id, counters.heap_, counters.heap_calls_);
+        }
+    }
+
+    void ThreadTable::Reset(std::size_t id) {
+        Chunk *chunk = chunks_[id >> kChunkBits].load(std::memory_order_acquire);
+        if (chunk == nullptr)
+            return;
+        const std::size_t slot = id & (kChunkSize - 1);
+        const std::pair<int64_t, Tick_t> recorded = chunk->Read(slot);
+        chunk->base_calls_[slot].store(recorded.first, std::memory_order_relaxed);
+        chunk->base_ticks_[slot].store(recorded.second, std::memory_order_relaxed);
+        ThreadHistogram *histogram = chunk->histograms_[slot].load(std::memory_order_acquire);
+        if (histogram != nullptr)
+            histogram->Reset();
+        CpuUsage *cpu_usage = chunk->cpu_usage_.load(std::memory_order_acquire);
+        if (cpu_usage != nullptr)
+            cpu_usage->Reset(slot);
+        PerfUsage *perf_usage = chunk->perf_usage_.load(std::memory_order_acquire);
+        if (perf_usage != nullptr)
+            perf_usage->Reset(slot);
+        AllocUsage *alloc_usage = chunk->alloc_usage_.load(std::memory_order_acquire);
+        if (alloc_usage != nullptr)
+            alloc_usage->Reset(slot);
+        ExemplarBuffer *exemplars = exemplars_.load(std::memory_order_acquire);
+        if (exemplars != nullptr)
+            exemplars->Clear(static_cast<uint32_t>(id));
+    }
+
+    ThreadTable *ThreadTable::Attach() {
+        // touch the guard so that its destructor runs when this thread exits
+        (void) &thread_guard_;
+        std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+        local_ = new ThreadTable{++thread_count_};
+        threads_.push_back(local_);
+        std::lock_guard<std::mutex> registry_lock{Tracer::registry_};
+        if (Tracer::giving_)
+            Tracer::Give(*local_);
+        return local_;
+    }
+
+    void ThreadTable::Detach() {
+        if (local_ == nullptr)
+            return;
+        std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+        retired_.Resize(RelationTree::node_table_.size());
+        local_->Collect(retired_);
+        {
+            std::lock_guard<std::mutex> registry_lock{Tracer::registry_};
+            Tracer::Take(*local_);
+        }
+        ExemplarBuffer *exemplars = local_->exemplars_.load(std::memory_order_relaxed);
+        if (exemplars != nullptr) {
+            exemplars->Collect(local_->index_, ExemplarBuffer::retired_);
+            ExemplarBuffer::Select(ExemplarBuffer::retired_);
+        }
+        for (auto iter = threads_.begin(); iter != threads_.end(); ++iter) {
+            if (*iter == local_) {
+                threads_.erase(iter);
+                break;
+            }
+        }
+        // cleared first, the hooks of TimerAlloc.h see the frees of the destructor
+        ThreadTable *table = local_;
+        local_ = nullptr;
+        delete table;
+    }
+
+    void ThreadTable::DropCaptures() {
+        ExemplarBuffer *exemplars = exemplars_.load(std::memory_order_relaxed);
+        if (exemplars != nullptr)
+            exemplars->Abandon();
+    }
+
+    bool ThreadTable::PopName(uint32_t name_id, Frame &frame) {
+        for (std::size_t depth = depth_; depth-- > 0;) {
+            uint32_t frame_name_id = stack_[depth].name_id_;
+            if (frame_name_id == kNoNode) {
+                const NodeInfo *info = RelationTree::node_info_.find(stack_[depth].id_);
+                frame_name_id = info == nullptr ? kNoNode : info->name_id_;
+            }
+            if (frame_name_id == name_id) {
+                Remove(depth, frame);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    TraceRing::TraceRing(std::size_t capacity) : mask_(capacity - 1), events_(new TimerTrace::Event[capacity]) {}
+
+    void Tracer::Open(const std::string &path) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ == -1)
+            throw std::runtime_error("cannot open trace file {" + path + "}");
+        map_ = nullptr;
+        mapped_ = 0;
+        size_ = sizeof(TimerTrace::FileHeader);
+        event_count_ = 0;
+        dropped_count_ = 0;
+        Write(nullptr, 0);
+    }
+
+    void Tracer::Write(const void *data, std::size_t size) {
+        if (size_ + size > mapped_) {
+            constexpr std::size_t kGranularity = std::size_t{1} << 24;
+            const std::size_t mapped = std::max(2 * mapped_, (size_ + size + kGranularity - 1) / kGranularity * kGranularity);
+            if (map_ != nullptr)
+                munmap(map_, mapped_);
+            void *map = MAP_FAILED;
+            if (ftruncate(fd_, static_cast<off_t>(mapped)) == 0)
+                map = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (map == MAP_FAILED) {
+                map_ = nullptr;
+                mapped_ = 0;
+                throw std::runtime_error("cannot grow the trace file");
+            }
+            map_ = static_cast<char *>(map);
+            mapped_ = mapped;
+        }
+        if (size != 0)
+            std::memcpy(map_ + size_, data, size);
+        size_ += size;
+    }
+
+    void Tracer::Drain(TraceRing &ring) {
+        uint64_t tail = ring.tail_.load(std::memory_order_relaxed);
+        const uint64_t head = ring.head_.load(std::memory_order_acquire);
+        while (tail != head) {
+            const uint64_t begin = tail & ring.mask_;
+            const uint64_t count = std::min(head - tail, ring.mask_ + 1 - begin);
+            Write(&ring.events_[begin], count * sizeof(TimerTrace::Event));
+            event_count_ += count;
+            tail += count;
+        }
+        ring.tail_.store(tail, std::memory_order_release);
+        const uint64_t dropped = ring.dropped_.load(std::memory_order_relaxed);
+        dropped_count_ += dropped - ring.dropped_flushed_;
+        ring.dropped_flushed_ = dropped;
+    }
+
+    void Tracer::DrainAll() {
+        {
+            std::lock_guard<std::mutex> registry_lock{registry_};
+            draining_.clear();
+            for (const auto &ring: rings_)
+                draining_.push_back(ring.get());
+            // taken before the copy, so drained for good below
+            drained_.assign(taken_rings_.begin(), taken_rings_.end());
+            taken_rings_.clear();
+        }
+        for (const auto ring: draining_)
+            Drain(*ring);
+        std::lock_guard<std::mutex> registry_lock{registry_};
+        free_rings_.insert(free_rings_.end(), drained_.begin(), drained_.end());
+    }
+
+    // the events left from an earlier trace are discarded
+    void Discard(TraceRing &ring) {
+        ring.tail_.store(ring.head_.load(std::memory_order_acquire), std::memory_order_release);
+        ring.dropped_flushed_ = ring.dropped_.load(std::memory_order_relaxed);
+    }
+
+    void Tracer::Give(ThreadTable &table) {
+        TraceRing *ring = table.trace_.load(std::memory_order_relaxed);
+        // a ring of another capacity is replaced, it stays in rings_ but is no longer given out
+        if (ring == nullptr || ring->mask_ + 1 != ring_capacity_) {
+            auto find = std::find_if(free_rings_.begin(), free_rings_.end(), [](const TraceRing *free_ring) {
+                return free_ring->mask_ + 1 == ring_capacity_;
+            });
+            if (find != free_rings_.end()) {
+                ring = *find;
+                free_rings_.erase(find);
+            } else {
+                // room for every ring in free_rings_ and taken_rings_, so that Take and DrainAll never allocate
+                free_rings_.reserve(rings_.size() + 1);
+                taken_rings_.reserve(rings_.size() + 1);
+                rings_.emplace_back(new TraceRing{ring_capacity_});
+                ring = rings_.back().get();
+            }
+        }
+        table.trace_.store(ring, std::memory_order_release);
+    }
+
+    void Tracer::Take(ThreadTable &table) noexcept {
+        TraceRing *ring = table.trace_.exchange(nullptr, std::memory_order_relaxed);
+        if (ring != nullptr)
+            taken_rings_.push_back(ring);
+    }
+
+    void Tracer::Flush() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        while (!stopping_) {
+            wake_.wait_for(lock, std::chrono::milliseconds{10});
+            try {
+                DrainAll();
+            } catch (const std::exception &exception) {
+                // keep recording untouched, the rings simply fill up and drop
+                enabled_.store(false, std::memory_order_relaxed);
+                std::cerr << "Timer tracing stopped: " << exception.what() << std::endl;
+                return;
+            }
+        }
+    }
+
+    // serializes the names of the subtree in pre-order, caller holds RelationTree::mutex_
+    void WriteNames(const RelationTree::RelationNode *root, std::string &names, uint64_t &count) {
+        for (const auto &node: root->descendants_) {
+            const TimerTrace::NameRecord record{static_cast<uint32_t>(node.second->id_),
+                                                static_cast<uint32_t>(root->id_),
+                                                static_cast<uint32_t>(node.first.size())};
+            names.append(reinterpret_cast<const char *>(&record), sizeof(record));
+            names += node.first;
+            ++count;
+            WriteNames(node.second.get(), names, count);
+        }
+    }
+
+    void Tracer::Close(const std::string &names, uint64_t name_count) {
+        struct Closer {
+            ~Closer() {
+                if (map_ != nullptr)
+                    munmap(map_, mapped_);
+                if (ftruncate(fd_, static_cast<off_t>(size_)) != 0)
+                    size_ = mapped_;
+                ::close(fd_);
+                fd_ = -1;
+                map_ = nullptr;
+                mapped_ = 0;
+            }
+        } closer;
+        if (map_ == nullptr)
+            throw std::runtime_error("trace file is incomplete");
+        DrainAll();
+        TimerTrace::FileHeader header{};
+        TimerTrace::SetMagic(header.magic_);
+        header.version_ = TimerTrace::kVersion;
+        header.event_size_ = sizeof(TimerTrace::Event);
+        header.ticks_per_second_ = static_cast<double>(Clock_t::getTicksPerSecond());
+        header.event_count_ = event_count_;
+        header.names_offset_ = size_;
+        Write(names.data(), names.size());
+        header.name_count_ = name_count;
+        header.dropped_count_ = dropped_count_;
+        std::memcpy(map_, &header, sizeof(header));
+    }
+
+    const NameCache::Entry *NameCache::find(const std::string &name) {
+        const std::uint64_t epoch = epoch_global_.load(std::memory_order_acquire);
+        if (epoch != epoch_) {
+            const ThreadTable::Internal internal;
+            entries_.clear();
+            epoch_ = epoch;
+        }
+        auto find = entries_.find(name);
+        return find == entries_.end() ? nullptr : &find->second;
     }
 
     template<Timer::TimeUnit_t>
     struct TimeUnitWrapper;
 
-    template<>
-    struct TimeUnitWrapper<Timer::ns> {
-        typedef std::pair<int64_t, std::chrono::nanoseconds> duration_t;
-        static const std::string name_;
-        static std::unordered_map<const RelationTree::RelationNode *, duration_t> duration_;
-    };
-    const std::string TimeUnitWrapper<Timer::ns>::name_{"ns"};
-    std::unordered_map<const RelationTree::RelationNode *, TimeUnitWrapper<Timer::ns>::duration_t> TimeUnitWrapper<Timer::ns>::duration_{};
+    template<>
+    struct TimeUnitWrapper<Timer::ns> {
+        typedef std::chrono::nanoseconds duration_t;
+        static const std::string name_;
+    };
+    const std::string TimeUnitWrapper<Timer::ns>::name_{"ns"};
+
+    template<>
+    struct TimeUnitWrapper<Timer::us> {
+        typedef std::chrono::microseconds duration_t;
+        static const std::string name_;
+    };
+    const std::string TimeUnitWrapper<Timer::us>::name_{"us"};
+
+    template<>
+    struct TimeUnitWrapper<Timer::ms> {
+        typedef std::chrono::milliseconds duration_t;
+        static const std::string name_;
+    };
+    const std::string TimeUnitWrapper<Timer::ms>::name_{"ms"};
+
+    template<>
+    struct TimeUnitWrapper<Timer::s> {
+        typedef std::chrono::seconds duration_t;
+        static const std::string name_;
+    };
+    const std::string TimeUnitWrapper<Timer::s>::name_{"s"};
+
+    template<>
+    struct TimeUnitWrapper<Timer::m> {
+        typedef std::chrono::minutes duration_t;
+        static const std::string name_;
+    };
+    const std::string TimeUnitWrapper<Timer::m>::name_{"m"};
+
+    template<>
+    struct TimeUnitWrapper<Timer::h> {
+        typedef std::chrono::hours duration_t;
+        static const std::string name_;
+    };
+    const std::string TimeUnitWrapper<Timer::h>::name_{"h"};
+
+    class DurationManager {
+        template<Timer::TimeUnit_t time_unit>
+        static long double getTicksPerUnitWrapper() {
+            typedef typename TimeUnitWrapper<time_unit>::duration_t::period Unit_p;
+            return Clock_t::getTicksPerSecond() * Unit_p::num / Unit_p::den;
+        }
+
+    public:
+        static const std::string &getName(Timer::TimeUnit_t time_unit) {
+            switch (time_unit) {
+                case Timer::ns:
+                    return TimeUnitWrapper<Timer::ns>::name_;
+                case Timer::us:
+                    return TimeUnitWrapper<Timer::us>::name_;
+                case Timer::ms:
+                    return TimeUnitWrapper<Timer::ms>::name_;
+                case Timer::s:
+                    return TimeUnitWrapper<Timer::s>::name_;
+                case Timer::m:
+                    return TimeUnitWrapper<Timer::m>::name_;
+                case Timer::h:
+                    return TimeUnitWrapper<Timer::h>::name_;
+            }
+            throw std::runtime_error("unknown time unit");
+        }
+
+        static long double getTicksPerUnit(Timer::TimeUnit_t time_unit) {
+            switch (time_unit) {
+                case Timer::ns:
+                    return getTicksPerUnitWrapper<Timer::ns>();
+                case Timer::us:
+                    return getTicksPerUnitWrapper<Timer::us>();
+                case Timer::ms:
+                    return getTicksPerUnitWrapper<Timer::ms>();
+                case Timer::s:
+                    return getTicksPerUnitWrapper<Timer::s>();
+                case Timer::m:
+                    return getTicksPerUnitWrapper<Timer::m>();
+                case Timer::h:
+                    return getTicksPerUnitWrapper<Timer::h>();
+            }
+            throw std::runtime_error("unknown time unit");
+        }
+
+        static long double CastTicks(Tick_t ticks, Timer::TimeUnit_t time_unit) {
+            return ticks / getTicksPerUnit(time_unit);
+        }
+
+        // readings of the enabled modes at the start of a period of activity of the node, taken before the clock
+        static void OpenUsage(ThreadTable &table, ThreadTable::Chunk &chunk, std::size_t slot) {
+            if (CpuClock::enabled_.load(std::memory_order_relaxed)) {
+                int64_t reading[CpuClock::kinds];
+                CpuClock::Read(reading);
+                ThreadTable::Chunk::getUsage(chunk.cpu_usage_).Open(slot, reading);
+            }
+            if (PerfCounters::enabled_.load(std::memory_order_relaxed)) {
+                int64_t reading[PerfCounters::kEvents];
+                if (table.ReadEvents(reading))
+                    ThreadTable::Chunk::getUsage(chunk.perf_usage_).Open(slot, reading);
+            }
+            if (AllocCounter::enabled_.load(std::memory_order_relaxed))
+                ThreadTable::Chunk::getUsage(chunk.alloc_usage_).Open(slot, table.live_bytes_, table.high_bytes_);
+        }
+
+        // Records the invocation of the frame just popped. Every invocation counts as a call and in the histogram, but
+        // the total only grows when the last open invocation of the node on the thread stops, by the whole period of
+        // activity, so that recursive and overlapping invocations are not counted twice.
+        // A skipped invocation of a sampled node returns a duration of 0. end is kUnread when the caller left
+        // reading the clock to it, which only happens for a recorded invocation or a recorded period.
+        static std::pair<std::size_t, std::size_t> insertRecord(Tick_t end, ThreadTable &table,
+                                                                const ThreadTable::Frame &frame,
+                                                                Timer::TimeUnit_t time_unit) {
+            ThreadTable::Chunk &chunk = table.getChunk(frame.id_);
+            const std::size_t slot = frame.id_ & (kChunkSize - 1);
+            const uint32_t weight = frame.weight_;
+            // the weight of the period is 0 when the invocation that opened it was skipped, its start is unset then
+            const bool closes = --chunk.active_[slot] == 0;
+            if (end == kUnread && (weight != 0 || (closes && chunk.weight_[slot] != 0)))
+                end = ReadClock();
+            const Tick_t duration = weight == 0 ? 0 : end - frame.start_;
+            const Tick_t period = !closes || chunk.weight_[slot] == 0
+                                  ? 0 : (end - chunk.start_[slot]) * chunk.weight_[slot];
+            PerfUsage *perf_usage = chunk.perf_usage_.load(std::memory_order_relaxed);
+            if (perf_usage != nullptr)
+                perf_usage->Count(slot, weight);
+            CpuUsage *cpu_usage = chunk.cpu_usage_.load(std::memory_order_relaxed);
+            if (cpu_usage != nullptr)
+                cpu_usage->Count(slot, weight);
+            AllocUsage *alloc_usage = chunk.alloc_usage_.load(std::memory_order_relaxed);
+            if (alloc_usage != nullptr)
+                alloc_usage->Count(slot, weight);
+            if (closes) {
+                if (alloc_usage != nullptr && alloc_usage->open_[slot])
+                    alloc_usage->Close(slot, table.high_bytes_);
+                if (perf_usage != nullptr && perf_usage->open_[slot]) {
+                    int64_t reading[PerfCounters::kEvents];
+                    if (table.ReadEvents(reading))
+                        perf_usage->Close(slot, reading, chunk.weight_[slot], period);
+                    else
+                        perf_usage->open_[slot] = false;
+                }
+                if (cpu_usage != nullptr && cpu_usage->open_[slot]) {
+                    int64_t reading[CpuClock::kinds];
+                    CpuClock::Read(reading);
+                    cpu_usage->Close(slot, reading, chunk.weight_[slot], period);
+                }
+            }
+            ExemplarBuffer *exemplars = table.exemplars_.load(std::memory_order_relaxed);
+            if (exemplars != nullptr && exemplars->open_ != 0 && weight != 0)
+                exemplars->Stop(frame.id_, frame.serial_, frame.start_, end, table.depth_);
+            if (weight != 0 || period != 0) {
+                if (weight != 0 && Tracer::enabled_.load(std::memory_order_relaxed))
+                    Tracer::Record(table, frame.id_, end, true);
+                const uint32_t sequence = chunk.sequence_[slot].load(std::memory_order_relaxed);
+                chunk.sequence_[slot].store(sequence + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                Accumulate(chunk.calls_[slot], int64_t{weight});
+                Accumulate(chunk.ticks_[slot], period);
+                chunk.sequence_[slot].store(sequence + 2, std::memory_order_release);
+                if (weight != 0)
+                    chunk.getHistogram(slot).Record(duration, weight);
+            }
+            const Tick_t total = chunk.ticks_[slot].load(std::memory_order_relaxed) -
+                                 chunk.base_ticks_[slot].load(std::memory_order_relaxed);
+            const long double ticks_per_unit = getTicksPerUnit(time_unit);
+            return {static_cast<std::size_t>(duration / ticks_per_unit),
+                    static_cast<std::size_t>(total / ticks_per_unit)};
+        }
+
+        // number of resets of each node, indexed by RelationNode::id_, guarded by RelationTree::mutex_
+        static std::vector<uint64_t> resets_;
+
+        // caller holds RelationTree::mutex_
+        static void Reset(const RelationTree::RelationNode *node_ptr) {
+            if (node_ptr->id_ >= resets_.size())
+                resets_.resize(node_ptr->id_ + 1, 0);
+            ++resets_[node_ptr->id_];
+            for (const auto table: ThreadTable::threads_)
+                table->Reset(node_ptr->id_);
+            if (node_ptr->id_ < ThreadTable::retired_.calls_.size()) {
+                ThreadTable::retired_.calls_[node_ptr->id_] = 0;
+                ThreadTable::retired_.ticks_[node_ptr->id_] = 0;
+                ThreadTable::retired_.histograms_[node_ptr->id_].reset();
+                for (auto &values: ThreadTable::retired_.cpu_)
+                    values[node_ptr->id_] = 0;
+                ThreadTable::retired_.cpu_calls_[node_ptr->id_] = 0;
+                ThreadTable::retired_.cpu_ticks_[node_ptr->id_] = 0;
+                for (auto &values: ThreadTable::retired_.events_)
+                    values[node_ptr->id_] = 0;
+                ThreadTable::retired_.events_calls_[node_ptr->id_] = 0;
+                ThreadTable::retired_.events_ticks_[node_ptr->id_] = 0;
+                for (auto &values: ThreadTable::retired_.heap_)
+                    values[node_ptr->id_] = 0;
+                ThreadTable::retired_.heap_calls_[node_ptr->id_] = 0;
+            }
+            auto &retired = ExemplarBuffer::retired_;
+            retired.erase(std::remove_if(retired.begin(), retired.end(), [node_ptr](const ExemplarBuffer::Copy &copy) {
+                return copy.id_ == node_ptr->id_;
+            }), retired.end());
+        }
+
+        // caller holds RelationTree::mutex_
+        static void ResetAll() {
+            for (const auto node_ptr: RelationTree::node_table_) {
+                if (node_ptr != nullptr && node_ptr != RelationTree::root_.get())
+                    Reset(node_ptr);
+            }
+        }
+
+        // merges the counters of the given thread, or of every thread when it is nullptr,
+        // caller holds RelationTree::mutex_
+        static Counters Collect(const ThreadTable *table, bool histograms = true) {
+            Counters counters;
+            counters.Resize(RelationTree::node_table_.size());
+            if (table != nullptr) {
+                table->Collect(counters, histograms);
+                return counters;
+            }
+            counters.Merge(ThreadTable::retired_);
+            for (const auto thread_table: ThreadTable::threads_)
+                thread_table->Collect(counters, histograms);
+            return counters;
+        }
+
+        // adds the histogram of one node from every thread to counters collected without histograms,
+        // caller holds RelationTree::mutex_
+        static void CollectHistogram(std::size_t id, Counters &counters) {
+            if (id < ThreadTable::retired_.histograms_.size() && ThreadTable::retired_.histograms_[id])
+                counters.getHistogram(id).Merge(*ThreadTable::retired_.histograms_[id]);
+            for (const auto thread_table: ThreadTable::threads_) {
+                const ThreadTable::Chunk *chunk = thread_table->findChunk(id);
+                const ThreadHistogram *histogram = chunk == nullptr ? nullptr
+                        : chunk->histograms_[id & (kChunkSize - 1)].load(std::memory_order_acquire);
+                if (histogram != nullptr)
+                    histogram->Collect(counters.getHistogram(id));
+            }
+        }
+    };
+
+    std::vector<uint64_t> DurationManager::resets_{};
+
+    void ExemplarBuffer::Stop(uint32_t id, uint32_t serial, Tick_t start, Tick_t end, std::size_t depth) {
+        // the pairs of a calibration run inside a captured invocation are not part of it
+        if (id == RelationTree::calibration_id_.load(std::memory_order_relaxed))
+            return;
+        std::size_t index = open_;
+        while (index-- > 0) {
+            if (captures_[index].serial_ == serial) {
+                const Capture capture = captures_[index];
+                std::copy(captures_ + index + 1, captures_ + open_, captures_ + index);
+                --open_;
+                Keep(capture, id, start, end - start, depth);
+                break;
+            }
+        }
+        // nothing else is captured, the spans are no longer needed
+        if (open_ == 0) {
+            size_ = 0;
+            return;
+        }
+        Append(id, static_cast<uint32_t>(depth), start, end - start);
+    }
+
+    void ExemplarBuffer::Append(uint32_t id, uint32_t depth, Tick_t start, Tick_t ticks) {
+        // merged into the previous span unless it was appended before the innermost capture opened
+        if (size_ > captures_[open_ - 1].mark_ && spans_[size_ - 1].id_ == id && spans_[size_ - 1].depth_ == depth) {
+            ++spans_[size_ - 1].calls_;
+            spans_[size_ - 1].ticks_ += ticks;
+            return;
+        }
+        if (size_ == kSpans) {
+            ++dropped_;
+            return;
+        }
+        spans_[size_++] = Span{id, depth, 1, start, ticks};
+    }
+
+    void ExemplarBuffer::Keep(const Capture &capture, uint32_t id, Tick_t start, Tick_t ticks, std::size_t depth) {
+        const NodeInfo *info = RelationTree::node_info_.find(id);
+        const uint32_t limit = info->exemplars_.load(std::memory_order_relaxed);
+        if (limit == 0 || ticks < info->exemplar_threshold_.load(std::memory_order_relaxed) *
+                                  DurationManager::getTicksPerUnit(info->time_unit_))
+            return;
+        // the slots of the node, and the fastest of them which is replaced once the node has limit of them
+        std::size_t count = 0;
+        Slot *free = nullptr;
+        Slot *fastest = nullptr;
+        for (auto &slot: slots_) {
+            const uint32_t state = slot.state_.load(std::memory_order_relaxed);
+            if (state == empty) {
+                if (free == nullptr)
+                    free = &slot;
+            } else if (state == ready && slot.id_ == id) {
+                ++count;
+                if (fastest == nullptr || slot.ticks_ < fastest->ticks_)
+                    fastest = &slot;
+            }
+        }
+        Slot *slot = count < limit && free != nullptr ? free : fastest;
+        if (slot == nullptr || (slot == fastest && fastest->ticks_ >= ticks))
+            return;
+        uint32_t state = slot->state_.load(std::memory_order_relaxed);
+        if (state == busy || !slot->state_.compare_exchange_strong(state, busy, std::memory_order_acquire))
+            return;
+        slot->id_ = id;
+        slot->limit_ = limit;
+        slot->start_ = start;
+        slot->ticks_ = ticks;
+        slot->dropped_ = dropped_ - capture.dropped_;
+        slot->count_ = 0;
+        // spans above the captured invocation on the stack stopped in it without being nested in it
+        for (std::size_t index = capture.mark_; index < size_; ++index) {
+            if (spans_[index].depth_ <= depth)
+                continue;
+            if (slot->count_ == kSlotSpans) {
+                ++slot->dropped_;
+                continue;
+            }
+            Span &span = slot->spans_[slot->count_++] = spans_[index];
+            span.depth_ -= static_cast<uint32_t>(depth) + 1;
+        }
+        slot->state_.store(ready, std::memory_order_release);
+    }
+
+    void ExemplarBuffer::Collect(std::size_t thread, std::vector<Copy> &copies) {
+        for (auto &slot: slots_) {
+            uint32_t state = ready;
+            // the owning thread only holds a slot while filling it
+            while (!slot.state_.compare_exchange_weak(state, busy, std::memory_order_acquire)) {
+                if (state == empty)
+                    break;
+                if (state == busy)
+                    std::this_thread::yield();
+                state = ready;
+            }
+            if (state == empty)
+                continue;
+            copies.push_back(Copy{thread, slot.id_, slot.limit_, slot.ticks_, slot.dropped_,
+                                  std::vector<Span>{slot.spans_, slot.spans_ + slot.count_}});
+            for (auto &span: copies.back().spans_)
+                span.start_ -= slot.start_;
+            slot.state_.store(ready, std::memory_order_release);
+        }
+    }
+
+    void ExemplarBuffer::Clear(uint32_t id) {
+        for (auto &slot: slots_) {
+            uint32_t state = ready;
+            while (!slot.state_.compare_exchange_weak(state, busy, std::memory_order_acquire)) {
+                if (state == empty)
+                    break;
+                if (state == busy)
+                    std::this_thread::yield();
+                state = ready;
+            }
+            if (state != empty)
+                slot.state_.store(id == kNoNode || slot.id_ == id ? empty : ready, std::memory_order_release);
+        }
+    }
+
+    void ExemplarBuffer::Select(std::vector<Copy> &copies) {
+        std::stable_sort(copies.begin(), copies.end(), [](const Copy &lhs, const Copy &rhs) {
+            return lhs.ticks_ > rhs.ticks_;
+        });
+        std::unordered_map<uint32_t, uint32_t> counts;
+        copies.erase(std::remove_if(copies.begin(), copies.end(), [&counts](const Copy &copy) {
+            return ++counts[copy.id_] > copy.limit_;
+        }), copies.end());
+    }
+
+    // Cost of the timer itself, measured by Calibrate and optionally subtracted from the reported totals.
+    // overhead_ and calibrated_ are guarded by RelationTree::mutex_.
+    struct OverheadManager {
+        OverheadManager() = delete;
+
+        static Timer::Overhead overhead_;
+        static bool calibrated_;
+        static std::atomic<bool> correction_;
+
+        // pair(handle) starts and stops the handle whatever the runtime switch says
+        template<typename Pair_t>
+        static Timer::Overhead Measure(Pair_t pair);
+
+        // calibrates once if the correction is enabled, caller does not hold RelationTree::mutex_
+        static void Prepare() {
+            if (!correction_.load(std::memory_order_relaxed))
+                return;
+            {
+                std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+                if (calibrated_)
+                    return;
+            }
+            Timer::Calibrate();
+        }
+
+        // Every recording nested in a node adds a whole Start/Stop pair to the node's total, and each recording
+        // of the node itself adds the part of its own pair between the two clock reads. Returns the number of
+        // recordings in the subtree, caller holds RelationTree::mutex_.
+        static int64_t Subtract(Counters &counters, const RelationTree::RelationNode *node_ptr) {
+            int64_t nested = 0;
+            for (const auto &node: node_ptr->descendants_)
+                nested += counters.calls_[node.second->id_] + Subtract(counters, node.second.get());
+            const int64_t calls = counters.calls_[node_ptr->id_];
+            if (calls != 0) {
+                const long double ticks_per_ns = Clock_t::getTicksPerSecond() / 1e9L;
+                const long double overhead =
+                        (nested * overhead_.pair_ns_ + calls * overhead_.inner_ns_) * ticks_per_ns;
+                Tick_t &ticks = counters.ticks_[node_ptr->id_];
+                ticks = std::max<Tick_t>(0, ticks - static_cast<Tick_t>(std::llround(overhead)));
+            }
+            return nested;
+        }
+
+        // DurationManager::Collect with the overhead subtracted when the correction is enabled,
+        // caller holds RelationTree::mutex_
+        static Counters Collect(const ThreadTable *table, bool histograms = true) {
+            Counters counters = DurationManager::Collect(table, histograms);
+            if (correction_.load(std::memory_order_relaxed))
+                Subtract(counters, RelationTree::root_.get());
+            return counters;
+        }
+
+        static const char *getTitleSuffix() {
+            return correction_.load(std::memory_order_relaxed)
+                   ? ", timer overhead subtracted (-1 means recorder not stopped):"
+                   : " (-1 means recorder not stopped):";
+        }
+    };
+
+    Timer::Overhead OverheadManager::overhead_{};
+    bool OverheadManager::calibrated_{false};
+    std::atomic<bool> OverheadManager::correction_{false};
+
+    template<typename Pair_t>
+    Timer::Overhead OverheadManager::Measure(Pair_t pair) {
+        // a node id outside of the tree, whatever is recorded on it is never reported
+        std::size_t id;
+        {
+            std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+            id = RelationTree::calibration_id_.load(std::memory_order_relaxed);
+            if (id == kNoNode) {
+                if (RelationTree::node_table_.size() >= kChunkSize * kMaxChunks)
+                    throw std::runtime_error("too many recorders to calibrate the timer");
+                id = RelationTree::node_table_.size();
+                RelationTree::node_table_.push_back(nullptr);
+                RelationTree::node_info_.Ensure(id).name_id_ = RelationTree::root_->name_id_;
+                RelationTree::calibration_id_.store(static_cast<uint32_t>(id), std::memory_order_relaxed);
+            }
+        }
+        const Timer::Handle handle{id, Timer::ns, false};
+        ThreadTable::Chunk &chunk = ThreadTable::Local().getChunk(id);
+        const std::size_t slot = id & (kChunkSize - 1);
+        const long double ns_per_tick = 1e9L / Clock_t::getTicksPerSecond();
+        constexpr int kRounds = 7;
+        constexpr int kIterations = 10000;
+        // the minimum over the rounds filters out preemptions and cold caches
+        Timer::Overhead overhead{std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+                                 std::numeric_limits<double>::max()};
+        for (int round = 0; round < kRounds; ++round) {
+            Tick_t sink = 0;
+            Tick_t begin = ReadClock();
+            for (int iteration = 0; iteration < kIterations; ++iteration)
+                sink += ReadClock();
+            Tick_t end = ReadClock();
+            static_cast<void>(*static_cast<volatile Tick_t *>(&sink));
+            overhead.clock_ns_ = std::min<double>(overhead.clock_ns_,
+                                                  (end - begin) * ns_per_tick / (kIterations + 1));
+
+            const Tick_t recorded = chunk.ticks_[slot].load(std::memory_order_relaxed);
+            begin = ReadClock();
+            for (int iteration = 0; iteration < kIterations; ++iteration)
+                pair(handle);
+            end = ReadClock();
+            overhead.pair_ns_ = std::min<double>(overhead.pair_ns_, (end - begin) * ns_per_tick / kIterations);
+            overhead.inner_ns_ = std::min<double>(
+                    overhead.inner_ns_,
+                    (chunk.ticks_[slot].load(std::memory_order_relaxed) - recorded) * ns_per_tick / kIterations);
+        }
+        return overhead;
+    }
+
+    // Writes what every node recorded during the last interval, along with the totals, in OpenMetrics text format.
+    // The text replaces a file at every interval, or is sent to each client connecting to a Unix socket.
+    // The exporter thread owns the state while it runs, StartExporter and StopExporter own it otherwise.
+    struct Exporter {
+        Exporter() = delete;
+
+        // serializes StartExporter and StopExporter
+        static std::mutex control_;
+        static std::thread thread_;
+        static std::string path_;
+        static std::chrono::milliseconds interval_;
+        // -1 when exporting to a file
+        static int listen_fd_;
+        // written by StopExporter to wake the exporter thread up
+        static int wake_[2];
+        // counters at the last interval, with the histograms of the nodes stopped since the exporter started
+        static Counters previous_;
+        // DurationManager::resets_ at the last interval
+        static std::vector<uint64_t> previous_resets_;
+        static std::chrono::steady_clock::time_point previous_time_;
+        static std::string text_;
+
+        static void Open(const std::string &path, std::chrono::milliseconds interval, bool unix_socket);
 
-    template<>
-    struct TimeUnitWrapper<Timer::us> {
-        typedef std::pair<int64_t, std::chrono::microseconds> duration_t;
-        static const std::string name_;
-        static std::unordered_map<const RelationTree::RelationNode *, duration_t> duration_;
-    };
-    const std::string TimeUnitWrapper<Timer::us>::name_{"us"};
-    std::unordered_map<const RelationTree::RelationNode *, TimeUnitWrapper<Timer::us>::duration_t> TimeUnitWrapper<Timer::us>::duration_{};
+        static void Close();
 
-    template<>
-    struct TimeUnitWrapper<Timer::ms> {
-        typedef std::pair<int64_t, std::chrono::milliseconds> duration_t;
-        static const std::string name_;
-        static std::unordered_map<const RelationTree::RelationNode *, duration_t> duration_;
-    };
-    const std::string TimeUnitWrapper<Timer::ms>::name_{"ms"};
-    std::unordered_map<const RelationTree::RelationNode *, TimeUnitWrapper<Timer::ms>::duration_t> TimeUnitWrapper<Timer::ms>::duration_{};
+        static void Run();
 
-    template<>
-    struct TimeUnitWrapper<Timer::s> {
-        typedef std::pair<int64_t, std::chrono::seconds> duration_t;
-        static const std::string name_;
-        static std::unordered_map<const RelationTree::RelationNode *, duration_t> duration_;
-    };
-    const std::string TimeUnitWrapper<Timer::s>::name_{"s"};
-    std::unordered_map<const RelationTree::RelationNode *, TimeUnitWrapper<Timer::s>::duration_t> TimeUnitWrapper<Timer::s>::duration_{};
+        // collects the counters under RelationTree::mutex_ and formats the deltas outside of it
+        static void Snapshot();
 
-    template<>
-    struct TimeUnitWrapper<Timer::m> {
-        typedef std::pair<int64_t, std::chrono::minutes> duration_t;
-        static const std::string name_;
-        static std::unordered_map<const RelationTree::RelationNode *, duration_t> duration_;
-    };
-    const std::string TimeUnitWrapper<Timer::m>::name_{"m"};
-    std::unordered_map<const RelationTree::RelationNode *, TimeUnitWrapper<Timer::m>::duration_t> TimeUnitWrapper<Timer::m>::duration_{};
+        static void Publish();
 
-    template<>
-    struct TimeUnitWrapper<Timer::h> {
-        typedef std::pair<int64_t, std::chrono::hours> duration_t;
-        static const std::string name_;
-        static std::unordered_map<const RelationTree::RelationNode *, duration_t> duration_;
+        static void Serve();
+
+        static std::string Escape(const std::string &text);
     };
-    const std::string TimeUnitWrapper<Timer::h>::name_{"h"};
-    std::unordered_map<const RelationTree::RelationNode *, TimeUnitWrapper<Timer::h>::duration_t> TimeUnitWrapper<Timer::h>::duration_{};
 
-    class DurationManager {
-        template<typename Duration_t, typename Node_t>
-        static auto
-        getCountWrapper(const std::unordered_map<const Node_t *, Duration_t> &duration, const Node_t *node_ptr) {
-            typedef std::pair<int64_t, int64_t> Ret_t;
-            auto find = duration.find(node_ptr);
-            ExistCheckerNoThrow(find, duration.end());
-            return ExistCheckerNoThrow(find, duration.end()) ? Ret_t{find->second.first, find->second.second.count()}
-                                                             : Ret_t{1, -1};
-        }
+    std::mutex Exporter::control_{};
+    std::thread Exporter::thread_{};
+    std::string Exporter::path_{};
+    std::chrono::milliseconds Exporter::interval_{};
+    int Exporter::listen_fd_{-1};
+    int Exporter::wake_[2]{-1, -1};
+    Counters Exporter::previous_{};
+    std::vector<uint64_t> Exporter::previous_resets_{};
+    std::chrono::steady_clock::time_point Exporter::previous_time_{};
+    std::string Exporter::text_{};
 
-        template<typename Duration_t, typename TimePoint_t, typename Node_t>
-        static auto
-        insertRecordWrapper(std::unordered_map<const Node_t *, std::pair<int64_t, Duration_t>> &duration,
-                            TimePoint_t &&start, TimePoint_t &&end,
-                            const Node_t *node_ptr) {
-            auto duration_find = duration.find(node_ptr);
-            const auto duration_{std::chrono::duration_cast<Duration_t>(end - start)};
-            if (duration_find == duration.end()) {
-                duration_find = duration.emplace(node_ptr, std::pair<int64_t, Duration_t>{1, duration_}).first;
+    void Exporter::Open(const std::string &path, std::chrono::milliseconds interval, bool unix_socket) {
+        if (interval.count() <= 0)
+            throw std::runtime_error("export interval must be positive");
+        if (unix_socket) {
+            sockaddr_un address{};
+            if (path.size() >= sizeof(address.sun_path))
+                throw std::runtime_error("socket path {" + path + "} too long");
+            address.sun_family = AF_UNIX;
+            std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+            listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            // a socket left by an earlier process is replaced
+            ::unlink(path.c_str());
+            if (listen_fd_ == -1 ||
+                ::bind(listen_fd_, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+                ::listen(listen_fd_, 8) != 0) {
+                Close();
+                throw std::runtime_error("cannot listen on socket {" + path + "}");
             }
-            else {
-                duration_find->second.first++;
-                duration_find->second.second += duration_;
-            }
-            return std::pair<std::size_t, std::size_t>{duration_.count(), duration_find->second.second.count()};
         }
+        if (::pipe(wake_) != 0) {
+            Close();
+            throw std::runtime_error("cannot create the exporter wake-up pipe");
+        }
+        path_ = path;
+        interval_ = interval;
+        text_ = "# EOF\n";
+        {
+            std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+            previous_ = DurationManager::Collect(nullptr);
+            previous_resets_ = DurationManager::resets_;
+        }
+        previous_time_ = std::chrono::steady_clock::now();
+    }
 
-        template<typename Duration_t, typename Node_t>
-        static void ResetWrapper(std::unordered_map<const Node_t *, std::pair<int64_t, Duration_t>> &duration,
-                                 const Node_t *node_ptr) {
-            duration.find(node_ptr)->second.second = Duration_t::zero();
+    void Exporter::Close() {
+        if (listen_fd_ != -1) {
+            ::close(listen_fd_);
+            ::unlink(path_.c_str());
         }
+        for (auto &fd: wake_) {
+            if (fd != -1)
+                ::close(fd);
+            fd = -1;
+        }
+        listen_fd_ = -1;
+    }
 
-    public:
-        static const std::string &getName(Timer::TimeUnit_t time_unit) {
-            switch (time_unit) {
-                case Timer::ns:
-                    return TimeUnitWrapper<Timer::ns>::name_;
-                case Timer::us:
-                    return TimeUnitWrapper<Timer::us>::name_;
-                case Timer::ms:
-                    return TimeUnitWrapper<Timer::ms>::name_;
-                case Timer::s:
-                    return TimeUnitWrapper<Timer::s>::name_;
-                case Timer::m:
-                    return TimeUnitWrapper<Timer::m>::name_;
-                case Timer::h:
-                    return TimeUnitWrapper<Timer::h>::name_;
+    void Exporter::Run() {
+        auto next = previous_time_ + interval_;
+        for (;;) {
+            const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    next - std::chrono::steady_clock::now());
+            pollfd fds[2]{{wake_[0], POLLIN, 0}, {listen_fd_, POLLIN, 0}};
+            const int ready = ::poll(fds, listen_fd_ == -1 ? 1 : 2,
+                                     static_cast<int>(std::max<long long>(0, timeout.count())));
+            if (ready > 0 && fds[0].revents != 0)
+                return;
+            try {
+                if (ready > 0 && fds[1].revents != 0)
+                    Serve();
+                if (std::chrono::steady_clock::now() >= next) {
+                    Snapshot();
+                    if (listen_fd_ == -1)
+                        Publish();
+                    next += interval_;
+                }
+            } catch (const std::exception &exception) {
+                std::cerr << "Timer exporter stopped: " << exception.what() << std::endl;
+                return;
             }
         }
+    }
 
-        static auto getCount(Timer::TimeUnit_t time_unit, const RelationTree::RelationNode *node_ptr) {
-            switch (time_unit) {
-                case Timer::ns:
-                    return getCountWrapper(TimeUnitWrapper<Timer::ns>::duration_, node_ptr);
-                case Timer::us:
-                    return getCountWrapper(TimeUnitWrapper<Timer::us>::duration_, node_ptr);
-                case Timer::ms:
-                    return getCountWrapper(TimeUnitWrapper<Timer::ms>::duration_, node_ptr);
-                case Timer::s:
-                    return getCountWrapper(TimeUnitWrapper<Timer::s>::duration_, node_ptr);
-                case Timer::m:
-                    return getCountWrapper(TimeUnitWrapper<Timer::m>::duration_, node_ptr);
-                case Timer::h:
-                    return getCountWrapper(TimeUnitWrapper<Timer::h>::duration_, node_ptr);
+    void Exporter::Snapshot() {
+        // paths in pre-order, so that a node's family keeps the tree order
+        std::vector<std::pair<std::string, std::size_t>> nodes;
+        Counters counters;
+        std::vector<uint64_t> resets;
+        {
+            std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+            // the histograms are only collected for the nodes stopped during the interval
+            counters = DurationManager::Collect(nullptr, false);
+            resets = DurationManager::resets_;
+            previous_.Resize(counters.calls_.size());
+            resets.resize(counters.calls_.size(), 0);
+            previous_resets_.resize(counters.calls_.size(), 0);
+            for (std::size_t id = 0; id < counters.calls_.size(); ++id) {
+                if (counters.calls_[id] != previous_.calls_[id] || resets[id] != previous_resets_[id])
+                    DurationManager::CollectHistogram(id, counters);
+            }
+            std::vector<std::pair<std::string, const RelationTree::RelationNode *>> pending{
+                    {"", RelationTree::root_.get()}};
+            while (!pending.empty()) {
+                const auto current = pending.back();
+                pending.pop_back();
+                for (const auto &node: current.second->descendants_) {
+                    const std::string path = current.first.empty() ? node.first : current.first + "/" + node.first;
+                    nodes.emplace_back(path, node.second->id_);
+                    pending.emplace_back(path, node.second.get());
+                }
             }
         }
+        const auto now = std::chrono::steady_clock::now();
+        const double seconds_per_tick = 1.0 / static_cast<double>(Clock_t::getTicksPerSecond());
 
-        template<typename TimePoint_t>
-        static auto
-        insertRecord(TimePoint_t &&start, TimePoint_t &&end, const RelationTree::RelationNode *node_ptr) {
-            switch (time_unit_map_.find(node_ptr)->second) {
-                case Timer::ns:
-                    return insertRecordWrapper(TimeUnitWrapper<Timer::ns>::duration_, std::forward<TimePoint_t>(start),
-                                        std::forward<TimePoint_t>(end), node_ptr);
-                case Timer::us:
-                    return insertRecordWrapper(TimeUnitWrapper<Timer::us>::duration_, std::forward<TimePoint_t>(start),
-                                        std::forward<TimePoint_t>(end), node_ptr);
-                case Timer::ms:
-                    return insertRecordWrapper(TimeUnitWrapper<Timer::ms>::duration_, std::forward<TimePoint_t>(start),
-                                        std::forward<TimePoint_t>(end), node_ptr);
-                case Timer::s:
-                    return insertRecordWrapper(TimeUnitWrapper<Timer::s>::duration_, std::forward<TimePoint_t>(start),
-                                        std::forward<TimePoint_t>(end), node_ptr);
-                case Timer::m:
-                    return insertRecordWrapper(TimeUnitWrapper<Timer::m>::duration_, std::forward<TimePoint_t>(start),
-                                        std::forward<TimePoint_t>(end), node_ptr);
-                case Timer::h:
-                    return insertRecordWrapper(TimeUnitWrapper<Timer::h>::duration_, std::forward<TimePoint_t>(start),
-                                        std::forward<TimePoint_t>(end), node_ptr);
+        constexpr std::size_t kQuantiles = 4;
+        static const char *const quantile_names[kQuantiles]{"0.5", "0.9", "0.99", "0.999"};
+        static const long double quantile_values[kQuantiles]{0.5L, 0.9L, 0.99L, 0.999L};
+        // a node reset during the interval counts from its reset
+        std::vector<int64_t> calls(counters.calls_.size());
+        std::vector<Tick_t> ticks(counters.calls_.size());
+        // kQuantiles entries per node of the interval, empty when the node was not stopped
+        std::vector<std::vector<Tick_t>> quantiles(nodes.size());
+        Histogram delta;
+        for (std::size_t index = 0; index < nodes.size(); ++index) {
+            const std::size_t id = nodes[index].second;
+            const bool reset = resets[id] != previous_resets_[id];
+            calls[id] = counters.calls_[id] - (reset ? 0 : previous_.calls_[id]);
+            ticks[id] = counters.ticks_[id] - (reset ? 0 : previous_.ticks_[id]);
+            if (!counters.histograms_[id])
+                continue;
+            const Histogram &current = *counters.histograms_[id];
+            const Histogram *previous = reset ? nullptr : previous_.histograms_[id].get();
+            std::size_t lowest = Histogram::kBuckets, highest = 0;
+            for (std::size_t bucket = 0; bucket < Histogram::kBuckets; ++bucket) {
+                const uint64_t before = previous ? previous->counts_[bucket] : 0;
+                // counts only grow between resets, a bucket below its previous count is treated as restarted
+                delta.counts_[bucket] = current.counts_[bucket] >= before ? current.counts_[bucket] - before
+                                                                          : current.counts_[bucket];
+                if (delta.counts_[bucket] != 0) {
+                    lowest = std::min(lowest, bucket);
+                    highest = bucket;
+                }
             }
+            if (lowest == Histogram::kBuckets)
+                continue;
+            // the extremes of the interval are only known up to their buckets
+            delta.min_ = std::max(current.min_, Histogram::getLowerBound(lowest));
+            delta.max_ = std::min(current.max_, Histogram::getUpperBound(highest));
+            for (const auto quantile: quantile_values)
+                quantiles[index].push_back(delta.getPercentile(quantile));
         }
 
-        static void Reset(Timer::TimeUnit_t time_unit, const RelationTree::RelationNode *node_ptr) {
-            switch (time_unit) {
-                case Timer::ns:
-                    ResetWrapper(TimeUnitWrapper<Timer::ns>::duration_, node_ptr);
-                    return;
-                case Timer::us:
-                    ResetWrapper(TimeUnitWrapper<Timer::us>::duration_, node_ptr);
-                    return;
-                case Timer::ms:
-                    ResetWrapper(TimeUnitWrapper<Timer::ms>::duration_, node_ptr);
-                    return;
-                case Timer::s:
-                    ResetWrapper(TimeUnitWrapper<Timer::s>::duration_, node_ptr);
-                    return;
-                case Timer::m:
-                    ResetWrapper(TimeUnitWrapper<Timer::m>::duration_, node_ptr);
-                    return;
-                case Timer::h:
-                    ResetWrapper(TimeUnitWrapper<Timer::h>::duration_, node_ptr);
-                    return;
+        std::ostringstream text;
+        text << std::setprecision(9);
+        const auto family = [&text](const char *name, const char *type, bool seconds, const char *help) {
+            text << "# TYPE " << name << ' ' << type << '\n';
+            if (seconds)
+                text << "# UNIT " << name << " seconds\n";
+            text << "# HELP " << name << ' ' << help << '\n';
+        };
+        family("timer_calls", "counter", false, "Recordings stopped since the last reset.");
+        for (const auto &node: nodes)
+            text << "timer_calls_total{path=\"" << Escape(node.first) << "\"} " << counters.calls_[node.second] << '\n';
+        family("timer_seconds", "counter", true, "Time recorded since the last reset.");
+        for (const auto &node: nodes)
+            text << "timer_seconds_total{path=\"" << Escape(node.first) << "\"} "
+                 << counters.ticks_[node.second] * seconds_per_tick << '\n';
+        family("timer_interval_calls", "gauge", false, "Recordings stopped during the last interval.");
+        for (const auto &node: nodes)
+            text << "timer_interval_calls{path=\"" << Escape(node.first) << "\"} " << calls[node.second] << '\n';
+        family("timer_interval_seconds", "gauge", true, "Time recorded during the last interval.");
+        for (const auto &node: nodes)
+            text << "timer_interval_seconds{path=\"" << Escape(node.first) << "\"} "
+                 << ticks[node.second] * seconds_per_tick << '\n';
+        family("timer_interval_latency_seconds", "summary", true, "Quantiles of the recordings of the last interval.");
+        for (std::size_t index = 0; index < nodes.size(); ++index) {
+            for (std::size_t quantile = 0; quantile < quantiles[index].size(); ++quantile) {
+                text << "timer_interval_latency_seconds{path=\"" << Escape(nodes[index].first) << "\",quantile=\""
+                     << quantile_names[quantile] << "\"} " << quantiles[index][quantile] * seconds_per_tick << '\n';
             }
+            if (quantiles[index].empty())
+                continue;
+            const std::size_t id = nodes[index].second;
+            text << "timer_interval_latency_seconds_count{path=\"" << Escape(nodes[index].first) << "\"} " << calls[id]
+                 << "\ntimer_interval_latency_seconds_sum{path=\"" << Escape(nodes[index].first) << "\"} "
+                 << ticks[id] * seconds_per_tick << '\n';
         }
+        family("timer_interval_length_seconds", "gauge", true, "Length of the last interval.");
+        text << "timer_interval_length_seconds " << std::chrono::duration<double>(now - previous_time_).count()
+             << "\n# EOF\n";
+        text_ = text.str();
+        // nodes not stopped during the interval keep their histogram from an earlier one
+        for (std::size_t id = 0; id < counters.calls_.size(); ++id) {
+            if (!counters.histograms_[id] && resets[id] == previous_resets_[id])
+                counters.histograms_[id] = std::move(previous_.histograms_[id]);
+        }
+        previous_ = std::move(counters);
+        previous_resets_ = std::move(resets);
+        previous_time_ = now;
+    }
 
-        static void Reset(const RelationTree::RelationNode *node_ptr) {
-            Timer::TimeUnit_t time_unit = time_unit_map_.find(node_ptr)->second;
-            switch (time_unit) {
-                case Timer::ns:
-                    ResetWrapper(TimeUnitWrapper<Timer::ns>::duration_, node_ptr);
-                    return;
-                case Timer::us:
-                    ResetWrapper(TimeUnitWrapper<Timer::us>::duration_, node_ptr);
-                    return;
-                case Timer::ms:
-                    ResetWrapper(TimeUnitWrapper<Timer::ms>::duration_, node_ptr);
-                    return;
-                case Timer::s:
-                    ResetWrapper(TimeUnitWrapper<Timer::s>::duration_, node_ptr);
-                    return;
-                case Timer::m:
-                    ResetWrapper(TimeUnitWrapper<Timer::m>::duration_, node_ptr);
-                    return;
-                case Timer::h:
-                    ResetWrapper(TimeUnitWrapper<Timer::h>::duration_, node_ptr);
-                    return;
+    void Exporter::Publish() {
+        // renamed over the previous file so that a scraper never reads half of it
+        const std::string temporary = path_ + ".tmp";
+        const int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+            throw std::runtime_error("cannot open export file {" + temporary + "}");
+        std::size_t written = 0;
+        while (written < text_.size()) {
+            const ssize_t result = ::write(fd, text_.data() + written, text_.size() - written);
+            if (result <= 0) {
+                ::close(fd);
+                throw std::runtime_error("cannot write export file {" + temporary + "}");
             }
+            written += static_cast<std::size_t>(result);
         }
+        ::close(fd);
+        if (std::rename(temporary.c_str(), path_.c_str()) != 0)
+            throw std::runtime_error("cannot replace export file {" + path_ + "}");
+    }
 
-        static void ResetAll() {
-            for (const auto time_unit_pair: time_unit_map_) {
-                Reset(time_unit_pair.second, time_unit_pair.first);
-            }
+    void Exporter::Serve() {
+        const int client = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1)
+            return;
+        // a client that does not read cannot hold the exporter for long
+        const timeval timeout{1, 0};
+        ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        std::size_t written = 0;
+        while (written < text_.size()) {
+            const ssize_t result = ::send(client, text_.data() + written, text_.size() - written, MSG_NOSIGNAL);
+            if (result <= 0)
+                break;
+            written += static_cast<std::size_t>(result);
         }
-    };
+        ::close(client);
+    }
+
+    std::string Exporter::Escape(const std::string &text) {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (const char c: text) {
+            if (c == '\\' || c == '"')
+                escaped += '\\';
+            if (c == '\n')
+                escaped += "\\n";
+            else
+                escaped += c;
+        }
+        return escaped;
+    }
+
+    // 4 significant digits without switching to the scientific notation
+    void PrintCompact(std::ostream &out, long double value) {
+        if (std::fabs(value) >= 1000)
+            out << static_cast<int64_t>(std::llround(value));
+        else
+            out << std::setprecision(4) << value;
+    }
+
+    void PrintHistogram(std::ostream &out, const Histogram &histogram, Timer::TimeUnit_t time_unit) {
+        static const std::pair<const char *, long double> percentiles[]{
+                {"p50", 0.5L}, {"p90", 0.9L}, {"p99", 0.99L}, {"p99.9", 0.999L}};
+        const std::string &unit_name = DurationManager::getName(time_unit);
+        auto print = [&out, &unit_name](const char *label, Tick_t ticks, Timer::TimeUnit_t time_unit) {
+            out << ", " << label << ' ';
+            PrintCompact(out, DurationManager::CastTicks(ticks, time_unit));
+            out << unit_name;
+        };
+        print("min", histogram.min_, time_unit);
+        for (const auto &percentile: percentiles)
+            print(percentile.first, histogram.getPercentile(percentile.second), time_unit);
+        print("max", histogram.max_, time_unit);
+    }
 
-    inline long double CastUnit(int64_t count, Timer::TimeUnit_t from, Timer::TimeUnit_t to) {
-        long double ratio = std::pow(10., 3 * (from - to));
-        return ratio * count;
+    // the number of calls a mode measured, when it did not measure all of them
+    void PrintMeasured(std::ostream &out, int64_t measured, int64_t calls) {
+        if (measured != calls)
+            out << " (" << measured << " of " << calls << " calls)";
+    }
+
+    // CPU time of the measured calls of the node and the rest of their recorded time, spent off the CPU waiting on
+    // locks, I/O or the scheduler
+    void PrintCpu(std::ostream &out, const Counters &counters, std::size_t id, Timer::TimeUnit_t time_unit) {
+        const Tick_t cpu = CpuClock::getTicks(counters.cpu_[CpuClock::cpu][id]);
+        const Tick_t off_cpu = std::max<Tick_t>(0, counters.cpu_ticks_[id] - cpu);
+        const std::string &unit_name = DurationManager::getName(time_unit);
+        out << ", cpu " << static_cast<int64_t>(DurationManager::CastTicks(cpu, time_unit)) << unit_name
+            << ", off-cpu " << static_cast<int64_t>(DurationManager::CastTicks(off_cpu, time_unit)) << unit_name
+            << ", switches " << counters.cpu_[CpuClock::voluntary][id] << " voluntary "
+            << counters.cpu_[CpuClock::involuntary][id] << " involuntary";
+        PrintMeasured(out, counters.cpu_calls_[id], counters.calls_[id]);
+    }
+
+    // IPC and misses per measured call from the hardware counters, or the software events counted instead of them
+    void PrintEvents(std::ostream &out, const Counters &counters, std::size_t id, Timer::TimeUnit_t time_unit) {
+        const long double calls = counters.events_calls_[id];
+        if (PerfCounters::source_.load(std::memory_order_relaxed) == PerfCounters::hardware) {
+            const int64_t cycles = counters.events_[PerfCounters::cycles][id];
+            out << ", ipc ";
+            if (cycles == 0)
+                out << "N/A";
+            else
+                PrintCompact(out, counters.events_[PerfCounters::instructions][id] / static_cast<long double>(cycles));
+            out << ", cache misses ";
+            PrintCompact(out, counters.events_[PerfCounters::cache_misses][id] / calls);
+            out << "/call, branch misses ";
+            PrintCompact(out, counters.events_[PerfCounters::branch_misses][id] / calls);
+            out << "/call";
+        } else {
+            const Tick_t task_clock = CpuClock::getTicks(counters.events_[PerfCounters::task_clock][id]);
+            out << ", task-clock " << static_cast<int64_t>(DurationManager::CastTicks(task_clock, time_unit))
+                << DurationManager::getName(time_unit) << ", page faults ";
+            PrintCompact(out, counters.events_[PerfCounters::page_faults][id] / calls);
+            out << "/call";
+        }
+        PrintMeasured(out, counters.events_calls_[id], counters.calls_[id]);
+    }
+
+    // allocations and bytes charged to the node itself per tracked call, and its peak growth of the live heap
+    void PrintHeap(std::ostream &out, const Counters &counters, std::size_t id) {
+        const long double calls = counters.heap_calls_[id];
+        out << ", allocs ";
+        PrintCompact(out, counters.heap_[AllocCounter::allocations][id] / calls);
+        out << "/call, bytes ";
+        PrintCompact(out, counters.heap_[AllocCounter::bytes][id] / calls);
+        out << "/call, peak " << counters.heap_[AllocCounter::peak][id] << " bytes";
+        PrintMeasured(out, counters.heap_calls_[id], counters.calls_[id]);
+    }
+
+    // name and node of a child in a report
+    typedef std::pair<const std::string *, const RelationTree::RelationNode *> Child_t;
+
+    // children of a node by decreasing recorded time, then by name
+    std::vector<Child_t> getSortedChildren(const Counters &counters, const RelationTree::RelationNode *node_ptr) {
+        std::vector<Child_t> children;
+        children.reserve(node_ptr->descendants_.size());
+        for (const auto &node: node_ptr->descendants_)
+            children.emplace_back(&node.first, node.second.get());
+        std::sort(children.begin(), children.end(), [&counters](const Child_t &lhs, const Child_t &rhs) {
+            const Tick_t lhs_ticks = counters.ticks_[lhs.second->id_];
+            const Tick_t rhs_ticks = counters.ticks_[rhs.second->id_];
+            return lhs_ticks != rhs_ticks ? lhs_ticks > rhs_ticks : *lhs.first < *rhs.first;
+        });
+        return children;
     }
 
     template<typename Node_t>
-    void PrintOneNodeHelper(int64_t father_count,
-                            Timer::TimeUnit_t time_unit_father,
+    void PrintOneNodeHelper(std::ostream &out,
+                            const Counters &counters,
+                            Tick_t father_ticks,
                             const Node_t *root,
                             const std::string &name,
                             int level,
                             bool recursive) {
-        Timer::TimeUnit_t time_unit;
-        int64_t count;
+        // -1 means recorder not stopped
+        Tick_t ticks = -1;
 #if __cplusplus > 201703L
       [[likely]]
 #endif
         if (level >= 0) {
-            time_unit = time_unit_map_.find(root)->second;
-            auto count_pair = DurationManager::getCount(time_unit, root);
-            count = count_pair.second;
-            std::cout
+            const Timer::TimeUnit_t time_unit = root->time_unit_;
+            const int64_t calls = counters.calls_[root->id_];
+            if (calls != 0)
+                ticks = counters.ticks_[root->id_];
+            const long double total = calls == 0 ? -1 : DurationManager::CastTicks(ticks, time_unit);
+            out
                     << std::setw(5 * level + 1)
                     << std::setfill(' ')
                     << '|'
@@ -311,106 +2702,890 @@ namespace {
                     << std::setfill('-')
                     << name
                     << ": "
-                    << count_pair.first
-                    << " call(s), total "
-                    << count
-                    << DurationManager::getName(time_unit)
-                    << ", average "
-                    << count / count_pair.first
-                    << DurationManager::getName(time_unit);
+                    << (calls == 0 ? 1 : calls)
+                    << " call(s), total ";
+            PrintCompact(out, total);
+            out << DurationManager::getName(time_unit) << ", average ";
+            PrintCompact(out, calls == 0 ? total : total / calls);
+            out << DurationManager::getName(time_unit);
 #if __cplusplus > 201703L
             [[likely]]
 #endif
             if (level > 0) {
-                if (father_count == -1)
-                    std::cout << ", ratio " << "N/A";
+                if (father_ticks == -1 || ticks == -1)
+                    out << ", ratio " << "N/A";
                 else
-                    std::cout
+                    out
                             << ", ratio "
                             << std::setprecision(4)
-                            << count / CastUnit(father_count, time_unit_father, time_unit);
+                            << static_cast<long double>(ticks) / father_ticks;
             }
-            std::cout << std::endl;
+            const Histogram *histogram = counters.histograms_[root->id_].get();
+            if (calls != 0 && histogram != nullptr)
+                PrintHistogram(out, *histogram, time_unit);
+            if (calls != 0 && counters.cpu_calls_[root->id_] != 0)
+                PrintCpu(out, counters, root->id_, time_unit);
+            if (calls != 0 && counters.events_calls_[root->id_] != 0)
+                PrintEvents(out, counters, root->id_, time_unit);
+            if (calls != 0 && counters.heap_calls_[root->id_] != 0)
+                PrintHeap(out, counters, root->id_);
+            out << '\n';
         }
 
         if (!recursive)
             return;
-        for (const auto &node: root->descendants_)
-            PrintOneNodeHelper(count, time_unit, node.second.get(), node.first, level + 1, recursive);
+        for (const auto &node: getSortedChildren(counters, root))
+            PrintOneNodeHelper(out, counters, ticks, node.second, *node.first, level + 1, recursive);
     }
 
+    // the report is built in memory and written to std::cout at once
     template<typename ...Args>
-    void PrintOneNode(Args&& ...args) {
-        PrintOneNodeHelper(0, Timer::s, std::forward<Args>(args)...);
+    void PrintOneNode(std::ostream &out, const Counters &counters, Args&& ...args) {
+        PrintOneNodeHelper(out, counters, -1, std::forward<Args>(args)...);
+    }
+
+    // %.9g, or with compact 4 significant digits and integers from 1000 on like the text reports
+    void AppendNumber(std::string &buffer, double value, bool compact = false) {
+        char text[32];
+        const int length = compact && std::fabs(value) >= 1000
+                           ? std::snprintf(text, sizeof(text), "%lld", static_cast<long long>(std::llround(value)))
+                           : std::snprintf(text, sizeof(text), compact ? "%.4g" : "%.9g", value);
+        buffer.append(text, static_cast<std::size_t>(length));
+    }
+
+    void AppendJsonString(std::string &buffer, const std::string &text) {
+        buffer += '"';
+        for (const char c: text) {
+            if (c == '"' || c == '\\') {
+                buffer += '\\';
+                buffer += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                buffer += escaped;
+            } else {
+                buffer += c;
+            }
+        }
+        buffer += '"';
+    }
+
+    void AppendCsvField(std::string &buffer, const std::string &text) {
+        if (text.find_first_of(",\"\r\n") == std::string::npos) {
+            buffer += text;
+            return;
+        }
+        buffer += '"';
+        for (const char c: text) {
+            if (c == '"')
+                buffer += '"';
+            buffer += c;
+        }
+        buffer += '"';
+    }
+
+    void WriteText(const std::vector<Timer::Record> &records, std::string &buffer) {
+        for (const auto &record: records) {
+            const std::string &unit_name = DurationManager::getName(record.time_unit_);
+            buffer.append(4 * record.depth_, ' ');
+            buffer += "|-- ";
+            buffer += record.name_;
+            buffer += ": ";
+            buffer += std::to_string(record.calls_);
+            buffer += " call(s), total ";
+            AppendNumber(buffer, record.total_, true);
+            buffer += unit_name;
+            buffer += ", self ";
+            AppendNumber(buffer, record.self_, true);
+            buffer += unit_name;
+            buffer += ", average ";
+            AppendNumber(buffer, record.calls_ == 0 ? 0 : record.total_ / record.calls_, true);
+            buffer += unit_name;
+            if (record.cpu_ >= 0) {
+                buffer += ", cpu ";
+                AppendNumber(buffer, record.cpu_, true);
+                buffer += unit_name;
+            }
+            buffer += '\n';
+        }
+    }
+
+    void WriteJson(const std::vector<Timer::Record> &records, std::string &buffer) {
+        buffer += "{\"records\":[";
+        for (std::size_t index = 0; index < records.size(); ++index) {
+            const Timer::Record &record = records[index];
+            buffer += index == 0 ? "\n{\"name\":" : ",\n{\"name\":";
+            AppendJsonString(buffer, record.name_);
+            buffer += ",\"path\":";
+            AppendJsonString(buffer, record.path_);
+            buffer += ",\"depth\":";
+            buffer += std::to_string(record.depth_);
+            buffer += ",\"calls\":";
+            buffer += std::to_string(record.calls_);
+            buffer += ",\"total\":";
+            AppendNumber(buffer, record.total_);
+            buffer += ",\"self\":";
+            AppendNumber(buffer, record.self_);
+            buffer += ",\"unit\":\"";
+            buffer += DurationManager::getName(record.time_unit_);
+            buffer += "\",\"cpu\":";
+            AppendNumber(buffer, record.cpu_);
+            buffer += ",\"voluntary_switches\":";
+            buffer += std::to_string(record.voluntary_switches_);
+            buffer += ",\"involuntary_switches\":";
+            buffer += std::to_string(record.involuntary_switches_);
+            buffer += '}';
+        }
+        buffer += "\n]}\n";
+    }
+
+    void WriteCsv(const std::vector<Timer::Record> &records, std::string &buffer) {
+        buffer += "path,depth,calls,total,self,unit,cpu,voluntary_switches,involuntary_switches\n";
+        for (const auto &record: records) {
+            AppendCsvField(buffer, record.path_);
+            buffer += ',';
+            buffer += std::to_string(record.depth_);
+            buffer += ',';
+            buffer += std::to_string(record.calls_);
+            buffer += ',';
+            AppendNumber(buffer, record.total_);
+            buffer += ',';
+            AppendNumber(buffer, record.self_);
+            buffer += ',';
+            buffer += DurationManager::getName(record.time_unit_);
+            buffer += ',';
+            AppendNumber(buffer, record.cpu_);
+            buffer += ',';
+            buffer += std::to_string(record.voluntary_switches_);
+            buffer += ',';
+            buffer += std::to_string(record.involuntary_switches_);
+            buffer += '\n';
+        }
+    }
+
+    // one line per node with self time, "root;father;name <self time in ns>", as read by flamegraph.pl
+    void WriteFolded(const std::vector<Timer::Record> &records, std::string &buffer) {
+        std::vector<std::string> stack;
+        for (const auto &record: records) {
+            std::string frame = record.name_;
+            std::replace(frame.begin(), frame.end(), ';', ':');
+            stack.resize(record.depth_);
+            stack.push_back(std::move(frame));
+            const long double self = record.self_ * DurationManager::getTicksPerUnit(record.time_unit_) /
+                                     DurationManager::getTicksPerUnit(Timer::ns);
+            const long long nanoseconds = std::llround(self);
+            if (nanoseconds <= 0)
+                continue;
+            for (std::size_t depth = 0; depth < stack.size(); ++depth) {
+                if (depth != 0)
+                    buffer += ';';
+                buffer += stack[depth];
+            }
+            buffer += ' ';
+            buffer += std::to_string(nanoseconds);
+            buffer += '\n';
+        }
+    }
+
+    // each exemplar and its spans as an indented tree
+    void WriteExemplars(const std::vector<Timer::Exemplar> &exemplars, std::string &buffer) {
+        for (const auto &exemplar: exemplars) {
+            const std::string &unit_name = DurationManager::getName(exemplar.time_unit_);
+            buffer += "|-- ";
+            buffer += exemplar.path_;
+            buffer += ": total ";
+            AppendNumber(buffer, exemplar.total_, true);
+            buffer += unit_name;
+            buffer += " on thread #";
+            buffer += std::to_string(exemplar.thread_);
+            if (exemplar.dropped_ != 0) {
+                buffer += ", ";
+                buffer += std::to_string(exemplar.dropped_);
+                buffer += " span(s) dropped";
+            }
+            buffer += '\n';
+            for (const auto &span: exemplar.spans_) {
+                buffer.append(4 * (span.depth_ + 1), ' ');
+                buffer += "|-- ";
+                buffer += span.name_;
+                buffer += ": ";
+                buffer += std::to_string(span.calls_);
+                buffer += " call(s), total ";
+                AppendNumber(buffer, span.total_, true);
+                buffer += unit_name;
+                buffer += ", at +";
+                AppendNumber(buffer, span.offset_, true);
+                buffer += unit_name;
+                buffer += '\n';
+            }
+        }
     }
 
 }
 
+void Timer::__SetEnabled(bool enabled) {
+    // async-signal-safe, called from the toggle signal handler
+    if (enabled && !enabled_.exchange(true, std::memory_order_relaxed))
+        ThreadTable::switch_epoch_global_.fetch_add(1, std::memory_order_relaxed);
+    else if (!enabled)
+        enabled_.store(false, std::memory_order_relaxed);
+}
+
+void Timer::__SetToggleSignal(int signal) {
+    struct sigaction action{};
+    action.sa_handler = [](int) { Timer::SetEnabled(!Timer::IsEnabled()); };
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (::sigaction(signal, &action, nullptr) != 0)
+        throw std::runtime_error("cannot install the toggle handler of signal " + std::to_string(signal));
+}
+
 void Timer::__SetDefaultTimeUnit(TimeUnit_t default_time_unit) { default_time_unit_ = default_time_unit; }
 
-void Timer::__StartRecording(const std::string &name, TimeUnit_t time_unit) {
-    if (RelationTree::plain_nodes_.find(name) == RelationTree::plain_nodes_.end()) {
-        std::unique_ptr<RelationTree::RelationNode> node_ptr{
-                new RelationTree::RelationNode{RelationTree::root_.get()}};
-        RelationTree::plain_nodes_.emplace(name, node_ptr.get());
-        time_unit_map_.emplace(node_ptr.get(), time_unit);
-        RelationTree::root_->descendants_.emplace(name, std::move(node_ptr));
-    } else if (RelationTree::root_->descendants_.find(name) == RelationTree::root_->descendants_.end()) {
-        throw std::runtime_error("name {" + name + "} duplicated");
+void Timer::__SetAutoParent(bool auto_parent) {
+    RelationTree::auto_parent_.store(auto_parent, std::memory_order_relaxed);
+}
+
+Timer::Handle Timer::__Register(const std::string &name, TimeUnit_t time_unit) {
+    const ThreadTable::Internal internal;
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    if (RelationTree::auto_parent_.load(std::memory_order_relaxed))
+        return Handle{RelationTree::getNameId(name), time_unit, true};
+    const RelationTree::RelationNode *node_ptr = RelationTree::Register(name, RelationTree::root_.get(), time_unit);
+    return Handle{node_ptr->id_, node_ptr->time_unit_, false};
+}
+
+Timer::Handle Timer::__Register(const std::string &name, const std::string &father_name, TimeUnit_t time_unit) {
+    const ThreadTable::Internal internal;
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    const RelationTree::RelationNode *node_ptr =
+            RelationTree::Register(name, RelationTree::getNodePtr(father_name), time_unit);
+    return Handle{node_ptr->id_, node_ptr->time_unit_, false};
+}
+
+Timer::Token Timer::__Start(Handle handle) {
+    ThreadTable &table = ThreadTable::Local();
+    table.CheckSwitch();
+#if __cplusplus > 201703L
+    [[unlikely]]
+#endif
+    if (table.Overflow(static_cast<uint32_t>(handle.id_), handle.floating_))
+        return Token{static_cast<uint32_t>(handle.id_), ThreadTable::kOverflowSerial};
+    uint32_t id = static_cast<uint32_t>(handle.id_);
+    uint32_t name_id = kNoNode;
+    if (handle.floating_) {
+        name_id = id;
+        const uint32_t father_id = table.getActiveId();
+        id = RelationTree::FindChild(father_id, name_id);
+#if __cplusplus > 201703L
+        [[unlikely]]
+#endif
+        if (id == kNoNode) {
+            std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+            const RelationTree::RelationNode *father_ptr = RelationTree::node_table_[father_id];
+            if (father_ptr == nullptr)
+                throw std::runtime_error("name {" + RelationTree::names_[name_id] + "} started in an erased scope");
+            id = static_cast<uint32_t>(RelationTree::getChild(father_ptr, name_id, handle.time_unit_)->id_);
+        }
+    }
+    ThreadTable::Chunk &chunk = table.getChunk(id);
+    const std::size_t slot = id & (kChunkSize - 1);
+    uint32_t weight = 1;
+#if __cplusplus > 201703L
+    [[unlikely]]
+#endif
+    if (Sampler::active_.load(std::memory_order_relaxed))
+        weight = Sampler::Sample(chunk, slot, id);
+    ThreadTable::Frame &frame = table.Push(id, name_id, weight);
+    const bool opens = chunk.active_[slot]++ == 0;
+    if (opens)
+        chunk.weight_[slot] = weight;
+    if (weight == 0)
+        return Token{id, frame.serial_};
+    if (opens)
+        DurationManager::OpenUsage(table, chunk, slot);
+    if (ExemplarBuffer::active_.load(std::memory_order_relaxed))
+        ExemplarBuffer::Open(table, id, frame.serial_);
+    const Tick_t start = ReadClock();
+    frame.start_ = start;
+    if (opens)
+        chunk.start_[slot] = start;
+    if (Tracer::enabled_.load(std::memory_order_relaxed))
+        Tracer::Record(table, id, start, false);
+    return Token{id, frame.serial_};
+}
+
+std::pair<std::size_t, std::size_t> Timer::__Stop(Handle handle) {
+    // with sampling, the clock is only read once the frame is known to be recorded
+    const Tick_t end = Sampler::active_.load(std::memory_order_relaxed) ? kUnread : ReadClock();
+    ThreadTable &table = ThreadTable::Local();
+    table.CheckSwitch();
+    if (table.Overflowed(static_cast<uint32_t>(handle.id_), handle.floating_))
+        return {0, 0};
+    ThreadTable::Frame frame;
+    const bool found = handle.floating_ ? table.PopName(static_cast<uint32_t>(handle.id_), frame)
+                                        : table.Pop(static_cast<uint32_t>(handle.id_), frame);
+    if (!found) {
+        if (table.isStraddling())
+            return {0, 0};
+        throw std::runtime_error("handle {" + std::to_string(handle.id_) + "} not started");
+    }
+    return DurationManager::insertRecord(end, table, frame, handle.floating_
+                                                            ? RelationTree::node_info_.find(frame.id_)->time_unit_
+                                                            : handle.time_unit_);
+}
+
+std::pair<std::size_t, std::size_t> Timer::__Stop(Token token) {
+    // with sampling, the clock is only read once the frame is known to be recorded
+    const Tick_t end = Sampler::active_.load(std::memory_order_relaxed) ? kUnread : ReadClock();
+    ThreadTable &table = ThreadTable::Local();
+    table.CheckSwitch();
+    // serial 0 comes from a start skipped by the runtime switch
+    if (token.serial_ == 0)
+        return {0, 0};
+    if (token.serial_ == ThreadTable::kOverflowSerial) {
+        table.Overflowed(token.id_);
+        return {0, 0};
+    }
+    ThreadTable::Frame frame;
+    if (!table.Pop(token.id_, token.serial_, frame)) {
+        if (table.isStraddling())
+            return {0, 0};
+        throw std::runtime_error("invocation {" + std::to_string(token.serial_) + "} of node {" +
+                                 std::to_string(token.id_) + "} not started on this thread");
     }
-    start_time_[RelationTree::getNodePtr(name)] = std::chrono::system_clock::now();
+    return DurationManager::insertRecord(end, table, frame, RelationTree::node_info_.find(frame.id_)->time_unit_);
 }
 
-void Timer::__StartRecording(const std::string &name, const std::string &father_name, TimeUnit_t time_unit) {
-    auto father_find = RelationTree::plain_nodes_.find(father_name);
-    auto find = RelationTree::plain_nodes_.find(name);
-    ExistChecker(father_find, RelationTree::plain_nodes_.end(), father_name);
-    if (RelationTree::plain_nodes_.find(name) == RelationTree::plain_nodes_.end()) {
-        std::unique_ptr<RelationTree::RelationNode> node_ptr{new RelationTree::RelationNode{father_find->second}};
-        RelationTree::plain_nodes_.emplace(name, node_ptr.get());
-        time_unit_map_.emplace(node_ptr.get(), time_unit);
-        const_cast<RelationTree::RelationNode *>(father_find->second)->descendants_.emplace(name,
-                                                                                            std::move(node_ptr));
-    } else if (father_find->second->descendants_.find(name) == father_find->second->descendants_.end()) {
-        throw std::runtime_error("name {" + name + "} duplicated");
+Timer::Token Timer::__StartRecording(const std::string &name, TimeUnit_t time_unit) {
+    NameCache &cache = NameCache::local_;
+    const NameCache::Entry *entry = cache.find(name);
+    const bool auto_parent = RelationTree::auto_parent_.load(std::memory_order_relaxed);
+    if (entry == nullptr || entry->handle_.floating_ != auto_parent ||
+        (!auto_parent && entry->father_id_ != RelationTree::root_->id_)) {
+        const ThreadTable::Internal internal;
+        const Handle handle = __Register(name, time_unit);
+        entry = &(cache.entries_[name] = NameCache::Entry{handle, RelationTree::root_->id_});
     }
-    start_time_[RelationTree::getNodePtr(name)] = std::chrono::system_clock::now();
+    return __Start(entry->handle_);
+}
+
+Timer::Token Timer::__StartRecording(const std::string &name, const std::string &father_name, TimeUnit_t time_unit) {
+    NameCache &cache = NameCache::local_;
+    const NameCache::Entry *entry = cache.find(name);
+    const NameCache::Entry *father_entry = cache.find(father_name);
+    if (entry == nullptr || entry->handle_.floating_ || father_entry == nullptr || father_entry->handle_.floating_ ||
+        entry->father_id_ != father_entry->handle_.id_) {
+        const ThreadTable::Internal internal;
+        std::size_t father_id;
+        if (father_entry != nullptr && !father_entry->handle_.floating_) {
+            father_id = father_entry->handle_.id_;
+        } else {
+            // the father is cached as well, so the next calls find both without the lock
+            std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+            const RelationTree::RelationNode *father_ptr = RelationTree::getNodePtr(father_name);
+            father_id = father_ptr->id_;
+            cache.entries_[father_name] = NameCache::Entry{Handle{father_id, father_ptr->time_unit_, false},
+                                                           father_ptr->parent->id_};
+        }
+        const Handle handle = __Register(name, father_name, time_unit);
+        entry = &(cache.entries_[name] = NameCache::Entry{handle, father_id});
+    }
+    return __Start(entry->handle_);
 }
 
 std::pair<std::size_t, std::size_t> Timer::__StopRecording(const std::string &name) {
-    const RelationTree::RelationNode *node_ptr = RelationTree::getNodePtr(name);
-    auto end_time_point = std::chrono::system_clock::now();
-    ExistChecker(start_time_.find(node_ptr), start_time_.end(), name);
-    return DurationManager::insertRecord(start_time_.find(node_ptr)->second, end_time_point, node_ptr);
+    // with sampling, the clock is only read once the frame is known to be recorded
+    const Tick_t end = Sampler::active_.load(std::memory_order_relaxed) ? kUnread : ReadClock();
+    NameCache &cache = NameCache::local_;
+    const NameCache::Entry *entry = cache.find(name);
+    if (entry == nullptr) {
+        const ThreadTable::Internal internal;
+        std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+        auto find = RelationTree::plain_nodes_.find(name);
+        if (find != RelationTree::plain_nodes_.end()) {
+            entry = &(cache.entries_[name] = NameCache::Entry{Handle{find->second->id_, find->second->time_unit_, false},
+                                                              find->second->parent->id_});
+        } else {
+            auto name_find = RelationTree::name_ids_.find(name);
+            // the start was skipped while the timer was switched off, so the name was never registered
+            if (name_find == RelationTree::name_ids_.end() && ThreadTable::Local().isStraddling())
+                return {0, 0};
+            ExistChecker(name_find, RelationTree::name_ids_.end(), name);
+            entry = &(cache.entries_[name] = NameCache::Entry{Handle{name_find->second, default_time_unit_, true},
+                                                              kNoNode});
+        }
+    }
+    ThreadTable &table = ThreadTable::Local();
+    table.CheckSwitch();
+    const Handle handle = entry->handle_;
+    if (table.Overflowed(static_cast<uint32_t>(handle.id_), handle.floating_))
+        return {0, 0};
+    ThreadTable::Frame frame;
+    const bool found = handle.floating_ ? table.PopName(static_cast<uint32_t>(handle.id_), frame)
+                                        : table.Pop(static_cast<uint32_t>(handle.id_), frame);
+    if (!found) {
+        if (table.isStraddling())
+            return {0, 0};
+        throw std::runtime_error("name {" + name + "} not started");
+    }
+    return DurationManager::insertRecord(end, table, frame, handle.floating_
+                                                            ? RelationTree::node_info_.find(frame.id_)->time_unit_
+                                                            : handle.time_unit_);
 }
 
 void Timer::__Erase(const std::string &name) {
-    auto find = RelationTree::plain_nodes_.find(name);
-    ExistChecker(find, RelationTree::plain_nodes_.end(), name);
-    const_cast<RelationTree::RelationNode *>(find->second->parent)->descendants_.erase(name);
-    RelationTree::plain_nodes_.erase(name);
+    const ThreadTable::Internal internal;
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    auto find = RelationTree::name_ids_.find(name);
+    if (find == RelationTree::name_ids_.end() || RelationTree::name_nodes_[find->second].empty())
+        throw std::runtime_error("name {" + name + "} not exist");
+    // erasing a node also erases the nodes of the same name below it
+    auto &nodes = RelationTree::name_nodes_[find->second];
+    if (std::find(nodes.begin(), nodes.end(), RelationTree::root_.get()) != nodes.end())
+        throw std::runtime_error("the root cannot be erased");
+    while (!nodes.empty())
+        const_cast<RelationTree::RelationNode *>(nodes.back()->parent)->descendants_.erase(name);
+    NameCache::epoch_global_.fetch_add(1, std::memory_order_release);
 }
 
 void Timer::__ResetAll() {
+    const ThreadTable::Internal internal;
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
     DurationManager::ResetAll();
 }
 
 void Timer::__Reset(const std::string &name) {
-    auto find = RelationTree::plain_nodes_.find(name);
-    ExistChecker(find, RelationTree::plain_nodes_.end(), name);
-    DurationManager::Reset(find->second);
+    const ThreadTable::Internal internal;
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    auto find = RelationTree::name_ids_.find(name);
+    if (find == RelationTree::name_ids_.end() || RelationTree::name_nodes_[find->second].empty())
+        throw std::runtime_error("name {" + name + "} not exist");
+    for (const auto node_ptr: RelationTree::name_nodes_[find->second])
+        DurationManager::Reset(node_ptr);
 }
 
 void Timer::__ReportAll() {
-    std::cout << "Report {all} in the recorder (-1 means recorder not stopped):" << std::endl;
-    PrintOneNode(RelationTree::root_.get(), "root", -1, true);
+    const ThreadTable::Internal internal;
+    OverheadManager::Prepare();
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    const Counters counters = OverheadManager::Collect(nullptr);
+    std::ostringstream out;
+    out << "Report {all} in the recorder" << OverheadManager::getTitleSuffix() << '\n';
+    PrintOneNode(out, counters, RelationTree::root_.get(), "root", -1, true);
+    const uint64_t overflows = ThreadTable::overflow_count_global_.load(std::memory_order_relaxed);
+    if (overflows != 0)
+        out << overflows << " recorders nested deeper than " << ThreadTable::kMaxDepth << " were not recorded\n";
+    std::cout << out.str() << std::flush;
+}
+
+void Timer::__ReportThreads() {
+    const ThreadTable::Internal internal;
+    OverheadManager::Prepare();
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    std::ostringstream out;
+    for (const auto table: ThreadTable::threads_) {
+        const Counters counters = OverheadManager::Collect(table);
+        out << "Report {all} of thread #" << table->index_ << OverheadManager::getTitleSuffix() << '\n';
+        PrintOneNode(out, counters, RelationTree::root_.get(), "root", -1, true);
+    }
+    if (!ThreadTable::retired_.calls_.empty()) {
+        Counters counters;
+        counters.Resize(RelationTree::node_table_.size());
+        counters.Merge(ThreadTable::retired_);
+        if (OverheadManager::correction_.load(std::memory_order_relaxed))
+            OverheadManager::Subtract(counters, RelationTree::root_.get());
+        out << "Report {all} of exited threads" << OverheadManager::getTitleSuffix() << '\n';
+        PrintOneNode(out, counters, RelationTree::root_.get(), "root", -1, true);
+    }
+    std::cout << out.str() << std::flush;
 }
 
 void Timer::__Report(const std::string &name, bool recursive) {
-    auto find = RelationTree::plain_nodes_.find(name);
-    ExistChecker(find, RelationTree::plain_nodes_.end(), name);
-    std::cout << "Report {" + name + "} in the recorder (-1 means recorder not stopped):" << std::endl;
-    PrintOneNode(find->second, name, 0, recursive);
+    const ThreadTable::Internal internal;
+    OverheadManager::Prepare();
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    auto find = RelationTree::name_ids_.find(name);
+    if (find == RelationTree::name_ids_.end() || RelationTree::name_nodes_[find->second].empty())
+        throw std::runtime_error("name {" + name + "} not exist");
+    const Counters counters = OverheadManager::Collect(nullptr);
+    std::ostringstream out;
+    out << "Report {" + name + "} in the recorder" << OverheadManager::getTitleSuffix() << '\n';
+    // one tree per calling context of the name, headed by its path
+    for (const auto node_ptr: RelationTree::name_nodes_[find->second])
+        PrintOneNode(out, counters, node_ptr, RelationTree::getPath(node_ptr), 0, recursive);
+    std::cout << out.str() << std::flush;
+}
+
+std::vector<Timer::Record> Timer::__Snapshot() {
+    OverheadManager::Prepare();
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    const Counters counters = OverheadManager::Collect(nullptr, false);
+    std::vector<Record> records;
+    // self time in ticks, the total of each node is subtracted from its father as it is visited
+    std::vector<Tick_t> self_ticks;
+    // record index of the ancestors of the node being visited, by depth
+    std::vector<std::size_t> ancestors;
+    struct Pending {
+        const std::string *name_;
+        const RelationTree::RelationNode *node_ptr_;
+        std::size_t depth_;
+    };
+    std::vector<Pending> pending;
+    const auto push_children = [&](const RelationTree::RelationNode *node_ptr, std::size_t depth) {
+        const std::vector<Child_t> children = getSortedChildren(counters, node_ptr);
+        for (auto child = children.rbegin(); child != children.rend(); ++child)
+            pending.push_back(Pending{child->first, child->second, depth});
+    };
+    push_children(RelationTree::root_.get(), 0);
+    while (!pending.empty()) {
+        const Pending current = pending.back();
+        pending.pop_back();
+        const std::size_t id = current.node_ptr_->id_;
+        const int64_t calls = counters.calls_[id];
+        const Tick_t ticks = calls == 0 ? 0 : counters.ticks_[id];
+        ancestors.resize(current.depth_);
+        std::string path = *current.name_;
+        if (current.depth_ != 0) {
+            path = records[ancestors.back()].path_ + '/' + path;
+            self_ticks[ancestors.back()] -= ticks;
+        }
+        ancestors.push_back(records.size());
+        const TimeUnit_t time_unit = current.node_ptr_->time_unit_;
+        records.push_back(Record{*current.name_, std::move(path), current.depth_, calls,
+                                 static_cast<double>(DurationManager::CastTicks(ticks, time_unit)), 0, time_unit,
+                                 counters.cpu_calls_[id] != 0 ? static_cast<double>(DurationManager::CastTicks(
+                                         CpuClock::getTicks(counters.cpu_[CpuClock::cpu][id]), time_unit)) : -1,
+                                 counters.cpu_[CpuClock::voluntary][id], counters.cpu_[CpuClock::involuntary][id]});
+        self_ticks.push_back(ticks);
+        push_children(current.node_ptr_, current.depth_ + 1);
+    }
+    for (std::size_t index = 0; index < records.size(); ++index) {
+        if (records[index].calls_ != 0)
+            records[index].self_ = static_cast<double>(
+                    DurationManager::CastTicks(std::max<Tick_t>(0, self_ticks[index]), records[index].time_unit_));
+    }
+    return records;
+}
+
+void Timer::__WriteSnapshot(const std::vector<Record> &records, Format_t format, std::string &buffer) {
+    switch (format) {
+        case text:
+            WriteText(records, buffer);
+            break;
+        case json:
+            WriteJson(records, buffer);
+            break;
+        case csv:
+            WriteCsv(records, buffer);
+            break;
+        case folded:
+            WriteFolded(records, buffer);
+            break;
+        default:
+            throw std::runtime_error("unknown snapshot format");
+    }
+}
+
+void Timer::__WriteSnapshot(const std::vector<Record> &records, Format_t format, std::ostream &stream) {
+    std::string buffer;
+    __WriteSnapshot(records, format, buffer);
+    stream.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+Timer::Overhead Timer::__Calibrate() {
+    // Measured on a thread of its own, so that the pairs are neither nested in the scopes open on the calling thread
+    // nor charged to their CPU time and allocations. Also measured while the runtime switch is off, its load is
+    // negligible next to the pair.
+    Overhead overhead{};
+    std::exception_ptr error;
+    std::thread{[&overhead, &error] {
+        try {
+            overhead = OverheadManager::Measure([](Handle handle) {
+                __Start(handle);
+                __Stop(handle);
+            });
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }}.join();
+    if (error)
+        std::rethrow_exception(error);
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    OverheadManager::overhead_ = overhead;
+    OverheadManager::calibrated_ = true;
+    return overhead;
+}
+
+Timer::Overhead Timer::__GetOverhead() {
+    {
+        std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+        if (OverheadManager::calibrated_)
+            return OverheadManager::overhead_;
+    }
+    return __Calibrate();
+}
+
+void Timer::__SetOverheadCorrection(bool correction) {
+    OverheadManager::correction_.store(correction, std::memory_order_relaxed);
+}
+
+void Timer::__SetSampling(const std::string &name, std::size_t period) {
+    const ThreadTable::Internal internal;
+    if (period == 0 || period > Sampler::kMaxPeriod)
+        throw std::runtime_error("sampling period of {" + name + "} out of range");
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    const uint32_t name_id = RelationTree::getNameId(name);
+    RelationTree::periods_[name_id] = static_cast<uint32_t>(period);
+    for (const auto node_ptr: RelationTree::name_nodes_[name_id])
+        RelationTree::node_info_.Ensure(node_ptr->id_).period_.store(static_cast<uint32_t>(period),
+                                                                    std::memory_order_relaxed);
+    const bool sampled = std::any_of(RelationTree::periods_.begin(), RelationTree::periods_.end(),
+                                     [](uint32_t value) { return value > 1; });
+    Sampler::active_.store(sampled || Sampler::cost_.load(std::memory_order_relaxed) > 0,
+                           std::memory_order_relaxed);
+}
+
+void Timer::__SetSamplingBudget(double percent) {
+    if (percent < 0 || percent >= 100)
+        throw std::runtime_error("sampling budget out of range");
+    const double cost = percent == 0 ? 0 : __GetOverhead().pair_ns_ * Clock_t::getTicksPerSecond() / 1e9 /
+                                           (percent / 100);
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    Sampler::cost_.store(cost, std::memory_order_relaxed);
+    const bool sampled = std::any_of(RelationTree::periods_.begin(), RelationTree::periods_.end(),
+                                     [](uint32_t value) { return value > 1; });
+    Sampler::active_.store(sampled || cost > 0, std::memory_order_relaxed);
+}
+
+void Timer::__SetExemplars(const std::string &name, std::size_t count, double threshold) {
+    const ThreadTable::Internal internal;
+    if (count > ExemplarBuffer::kSlots || threshold < 0)
+        throw std::runtime_error("exemplars of {" + name + "} out of range");
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    const uint32_t name_id = RelationTree::getNameId(name);
+    RelationTree::exemplars_[name_id] = {static_cast<uint32_t>(count), threshold};
+    for (const auto node_ptr: RelationTree::name_nodes_[name_id]) {
+        NodeInfo &info = RelationTree::node_info_.Ensure(node_ptr->id_);
+        info.exemplar_threshold_.store(threshold, std::memory_order_relaxed);
+        info.exemplars_.store(static_cast<uint32_t>(count), std::memory_order_relaxed);
+    }
+    ExemplarBuffer::active_.store(std::any_of(RelationTree::exemplars_.begin(), RelationTree::exemplars_.end(),
+                                              [](const std::pair<uint32_t, double> &value) {
+                                                  return value.first != 0;
+                                              }), std::memory_order_relaxed);
+}
+
+std::vector<Timer::Exemplar> Timer::__Exemplars() {
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    std::vector<ExemplarBuffer::Copy> copies = ExemplarBuffer::retired_;
+    for (const auto table: ThreadTable::threads_) {
+        ExemplarBuffer *buffer = table->exemplars_.load(std::memory_order_acquire);
+        if (buffer != nullptr)
+            buffer->Collect(table->index_, copies);
+    }
+    ExemplarBuffer::Select(copies);
+    std::vector<Exemplar> exemplars;
+    for (auto &copy: copies) {
+        const RelationTree::RelationNode *node_ptr = RelationTree::node_table_[copy.id_];
+        // erased nodes are never reported
+        if (node_ptr == nullptr)
+            continue;
+        std::string path = RelationTree::getPath(node_ptr);
+        const TimeUnit_t time_unit = node_ptr->time_unit_;
+        std::sort(copy.spans_.begin(), copy.spans_.end(),
+                  [](const ExemplarBuffer::Span &lhs, const ExemplarBuffer::Span &rhs) {
+                      return lhs.start_ != rhs.start_ ? lhs.start_ < rhs.start_ : lhs.depth_ < rhs.depth_;
+                  });
+        std::vector<Span> spans;
+        spans.reserve(copy.spans_.size());
+        for (const auto &span: copy.spans_)
+            spans.push_back(Span{RelationTree::names_[RelationTree::node_info_.find(span.id_)->name_id_], span.depth_,
+                                 span.calls_, static_cast<double>(DurationManager::CastTicks(span.start_, time_unit)),
+                                 static_cast<double>(DurationManager::CastTicks(span.ticks_, time_unit))});
+        exemplars.push_back(Exemplar{std::move(path), copy.thread_,
+                                     static_cast<double>(DurationManager::CastTicks(copy.ticks_, time_unit)),
+                                     time_unit, std::move(spans), copy.dropped_});
+    }
+    return exemplars;
+}
+
+void Timer::__ReportExemplars() {
+    const ThreadTable::Internal internal;
+    std::string buffer{"Exemplars in the recorder:\n"};
+    WriteExemplars(__Exemplars(), buffer);
+    std::cout << buffer << std::flush;
+}
+
+void Timer::__SetCpuTime(bool cpu_time) {
+    // periods of activity already open stay unmeasured
+    CpuClock::enabled_.store(cpu_time, std::memory_order_relaxed);
+}
+
+void Timer::__SetPerfCounters(bool perf_counters) {
+    if (perf_counters) {
+        // opens the group of the calling thread, other threads open theirs on their first recording
+        int64_t reading[PerfCounters::kEvents];
+        if (!ThreadTable::Local().ReadEvents(reading))
+            throw std::runtime_error("perf_event_open is not available, see /proc/sys/kernel/perf_event_paranoid");
+    }
+    PerfCounters::enabled_.store(perf_counters, std::memory_order_relaxed);
+}
+
+void Timer::__SetAllocationTracking(bool allocation_tracking) {
+    if (allocation_tracking && !AllocCounter::installed_.load(std::memory_order_relaxed))
+        throw std::runtime_error("no allocation hook, link TimerNew.cpp or the TimerMalloc library");
+    AllocCounter::enabled_.store(allocation_tracking, std::memory_order_relaxed);
+}
+
+void TimerAlloc::Install() noexcept {
+    AllocCounter::installed_.store(true, std::memory_order_relaxed);
+}
+
+void TimerAlloc::Allocate(std::size_t size) noexcept {
+    // never attaches a table, which allocates, from inside an allocation
+    ThreadTable *table = ThreadTable::local_;
+    if (table == nullptr || ThreadTable::internal_ || !AllocCounter::enabled_.load(std::memory_order_relaxed))
+        return;
+    table->live_bytes_ += static_cast<int64_t>(size);
+    table->high_bytes_ = std::max(table->high_bytes_, table->live_bytes_);
+    if (table->depth_ == 0)
+        return;
+    const uint32_t id = table->stack_[table->depth_ - 1].id_;
+    // the chunk of a started node always exists
+    ThreadTable::Chunk *chunk = table->chunks_[id >> kChunkBits].load(std::memory_order_relaxed);
+    AllocUsage *usage = chunk->alloc_usage_.load(std::memory_order_relaxed);
+    if (usage != nullptr)
+        usage->Charge(id & (kChunkSize - 1), static_cast<int64_t>(size));
+}
+
+void TimerAlloc::Deallocate(std::size_t size) noexcept {
+    ThreadTable *table = ThreadTable::local_;
+    if (table != nullptr && !ThreadTable::internal_ && AllocCounter::enabled_.load(std::memory_order_relaxed))
+        table->live_bytes_ -= static_cast<int64_t>(size);
+}
+
+void Timer::__StartTracing(const std::string &path, std::size_t events_per_thread) {
+    const ThreadTable::Internal internal;
+    std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+    std::lock_guard<std::mutex> trace_lock{Tracer::mutex_};
+    if (Tracer::fd_ != -1)
+        throw std::runtime_error("tracing already started");
+    std::size_t capacity = 2;
+    while (capacity < events_per_thread)
+        capacity <<= 1;
+    {
+        std::lock_guard<std::mutex> registry_lock{Tracer::registry_};
+        // no flusher runs, the events left from an earlier trace are discarded and the rings of exited threads are free
+        for (const auto &ring: Tracer::rings_)
+            Discard(*ring);
+        Tracer::free_rings_.insert(Tracer::free_rings_.end(), Tracer::taken_rings_.begin(), Tracer::taken_rings_.end());
+        Tracer::taken_rings_.clear();
+        // every attached thread gets its ring now, threads attaching later get theirs in Attach
+        Tracer::ring_capacity_ = capacity;
+        Tracer::giving_ = true;
+        for (const auto table: ThreadTable::threads_)
+            Tracer::Give(*table);
+    }
+    try {
+        Tracer::Open(path);
+    } catch (...) {
+        std::lock_guard<std::mutex> registry_lock{Tracer::registry_};
+        Tracer::giving_ = false;
+        throw;
+    }
+    Tracer::stopping_ = false;
+    Tracer::flusher_ = std::thread{Tracer::Flush};
+    Tracer::enabled_.store(true, std::memory_order_release);
+    // a program returning from main while tracing still joins the flusher and gets a complete file
+    static const int at_exit = std::atexit([] {
+        try {
+            Timer::StopTracing();
+        } catch (const std::exception &exception) {
+            std::cerr << "Timer tracing stopped: " << exception.what() << std::endl;
+        }
+    });
+    (void) at_exit;
+}
+
+void Timer::__StopTracing() {
+    const ThreadTable::Internal internal;
+    std::thread flusher;
+    {
+        std::lock_guard<std::mutex> lock{Tracer::mutex_};
+        if (Tracer::fd_ == -1 || Tracer::stopping_)
+            return;
+        Tracer::enabled_.store(false, std::memory_order_relaxed);
+        Tracer::stopping_ = true;
+        flusher = std::move(Tracer::flusher_);
+        std::lock_guard<std::mutex> registry_lock{Tracer::registry_};
+        Tracer::giving_ = false;
+    }
+    Tracer::wake_.notify_all();
+    flusher.join();
+    // the names are copied first so that the tree is not locked while the file is written
+    std::string names;
+    uint64_t name_count = 0;
+    {
+        std::lock_guard<std::mutex> lock{RelationTree::mutex_};
+        WriteNames(RelationTree::root_.get(), names, name_count);
+    }
+    std::lock_guard<std::mutex> lock{Tracer::mutex_};
+    Tracer::Close(names, name_count);
+}
+
+void Timer::__StartExporter(const std::string &path, std::size_t interval_ms, bool unix_socket) {
+    const ThreadTable::Internal internal;
+    std::lock_guard<std::mutex> lock{Exporter::control_};
+    if (Exporter::thread_.joinable())
+        throw std::runtime_error("exporter already started");
+    Exporter::Open(path, std::chrono::milliseconds{interval_ms}, unix_socket);
+    Exporter::thread_ = std::thread{Exporter::Run};
+    // a program returning from main while exporting still joins the exporter thread
+    static const int at_exit = std::atexit([] {
+        try {
+            Timer::StopExporter();
+        } catch (const std::exception &exception) {
+            std::cerr << "Timer exporter stopped: " << exception.what() << std::endl;
+        }
+    });
+    (void) at_exit;
+}
+
+void Timer::__StopExporter() {
+    const ThreadTable::Internal internal;
+    std::lock_guard<std::mutex> lock{Exporter::control_};
+    if (!Exporter::thread_.joinable())
+        return;
+    const char wake = 0;
+    if (::write(Exporter::wake_[1], &wake, 1) != 1)
+        throw std::runtime_error("cannot wake the exporter up");
+    Exporter::thread_.join();
+    Exporter::Close();
 }
 
+std::atomic<bool> Timer::enabled_{true};
+
 Timer::TimeUnit_t Timer::default_time_unit_{ms};
+
+namespace {
+    // Applies TIMER_ENABLED and TIMER_TOGGLE_SIGNAL at load time
+    struct SwitchEnvironment {
+        SwitchEnvironment() {
+            const char *enabled = std::getenv("TIMER_ENABLED");
+            if (enabled != nullptr && std::strcmp(enabled, "0") == 0)
+                Timer::SetEnabled(false);
+            const char *signal = std::getenv("TIMER_TOGGLE_SIGNAL");
+            if (signal == nullptr)
+                return;
+            // an error here would terminate the process before main, so the toggle is left off instead
+            try {
+                Timer::SetToggleSignal(std::atoi(signal));
+            } catch (const std::exception &exception) {
+                std::cerr << "Timer ignores TIMER_TOGGLE_SIGNAL=" << signal << ": " << exception.what() << std::endl;
+            }
+        }
+    };
+
+    const SwitchEnvironment switch_environment_{};
+}
@@ -9,37 +9,307 @@
 #define TIMER_USE_TIMER true
 #endif
 
+// Clock source used when compiling Timer.cpp
+#define TIMER_CLOCK_STEADY 0
+#define TIMER_CLOCK_MONOTONIC_RAW 1
+#define TIMER_CLOCK_TSC 2
+
+#ifndef TIMER_CLOCK
+#define TIMER_CLOCK TIMER_CLOCK_STEADY
+#endif
+
 #include <string>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <iosfwd>
+#include <cstdint>
 
 struct Timer final {
     Timer() = delete;
 
     enum TimeUnit_t { ns, us, ms, s, m, h };
 
-    static void SetDefaultTimeUnit(TimeUnit_t default_time_unit) { if (TIMER_USE_TIMER) __SetDefaultTimeUnit(default_time_unit); }
+    class Scope;
+
+    // Renderings of a snapshot: an indented tree, JSON, CSV, or folded stacks for flame graphs
+    enum Format_t { text, json, csv, folded };
+
+    // One node of a snapshot, durations are in the node's time unit
+    struct Record {
+        std::string name_;
+        // names from the root joined by '/'
+        std::string path_;
+        // 0 for a child of the root
+        std::size_t depth_;
+        int64_t calls_;
+        double total_;
+        // total minus the totals of the children
+        double self_;
+        TimeUnit_t time_unit_;
+        // CPU time of the measured calls, -1 when no call was measured, see SetCpuTime()
+        double cpu_;
+        int64_t voluntary_switches_;
+        int64_t involuntary_switches_;
+    };
+
+    // Invocations of a node that stopped inside an exemplar, consecutive ones at the same depth are merged
+    struct Span {
+        std::string name_;
+        // 0 for an invocation directly inside the exemplar
+        std::size_t depth_;
+        int64_t calls_;
+        // from the start of the exemplar to the start of the first invocation, durations are in the exemplar's unit
+        double offset_;
+        double total_;
+    };
+
+    // One of the slowest invocations of a node, kept under SetExemplars()
+    struct Exemplar {
+        // names from the root joined by '/'
+        std::string path_;
+        // thread number, as in ReportThreads()
+        std::size_t thread_;
+        double total_;
+        TimeUnit_t time_unit_;
+        // in pre-order
+        std::vector<Span> spans_;
+        // spans that did not fit the buffers of the thread
+        uint64_t dropped_;
+    };
+
+    // Cost of the instrumentation on this machine, in nanoseconds
+    struct Overhead {
+        // one clock read
+        double clock_ns_;
+        // an empty Start/Stop pair through a handle, as seen by an enclosing recorder
+        double pair_ns_;
+        // the part of a pair that falls between its own two clock reads
+        double inner_ns_;
+    };
+
+    // Interned reference to a recorder, obtained once from Register() so that Start()/Stop() are plain index accesses
+    struct Handle {
+        // node id, or name id of a floating handle
+        std::size_t id_;
+        TimeUnit_t time_unit_;
+        // registered without a father under SetAutoParent(true), resolved against the innermost active scope
+        bool floating_;
+    };
+
+    // One invocation of a recorder, returned by Start() and StartRecording(). Stopping through it ends that invocation
+    // even when several of the same recorder overlap on the thread and stop in another order than they started.
+    struct Token {
+        uint32_t id_;
+        // 0 when the start was skipped by the runtime switch
+        uint32_t serial_;
+    };
+
+#if TIMER_USE_TIMER
+    // Runtime switch of the recording functions, checked with a single relaxed load. It starts as the environment
+    // variable TIMER_ENABLED says, on unless it is 0.
+    static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    static void SetEnabled(bool enabled) { __SetEnabled(enabled); }
+
+    // Flips the runtime switch whenever the process receives the signal, also installed for the signal number
+    // in the environment variable TIMER_TOGGLE_SIGNAL
+    static void SetToggleSignal(int signal) { __SetToggleSignal(signal); }
+
+    static void SetDefaultTimeUnit(TimeUnit_t default_time_unit) { __SetDefaultTimeUnit(default_time_unit); }
+
+    // Recorders started without a father attach to the innermost recorder active on the thread instead of the root,
+    // so that one name may appear under several fathers. Set it before registering anything.
+    static void SetAutoParent(bool auto_parent) { __SetAutoParent(auto_parent); }
+
+    static Handle Register(const std::string &name, TimeUnit_t time_unit = default_time_unit_) { return __Register(name, time_unit); };
+
+    static Handle Register(const std::string &name, const std::string &father_name, TimeUnit_t time_unit = default_time_unit_) { return __Register(name, father_name, time_unit); };
+
+    // Invocations of a recorder may nest, e.g., in a recursive function: each is a call, but the total only counts the
+    // time during which at least one of them was running on the thread
+    static Token Start(Handle handle) { if (IsEnabled()) return __Start(handle); return Token{0, 0}; };
+
+    // stops the innermost invocation of the recorder on the thread
+    static std::pair<std::size_t, std::size_t> Stop(Handle handle) { if (IsEnabled()) return __Stop(handle); return {0, 0}; };
+
+    static std::pair<std::size_t, std::size_t> Stop(Token token) { if (IsEnabled()) return __Stop(token); return {0, 0}; };
+
+    static Token StartRecording(const std::string &name, TimeUnit_t time_unit = default_time_unit_) { if (IsEnabled()) return __StartRecording(name, time_unit); return Token{0, 0}; };
+
+    static Token StartRecording(const std::string &name, const std::string &father_name, TimeUnit_t time_unit = default_time_unit_) { if (IsEnabled()) return __StartRecording(name, father_name, time_unit); return Token{0, 0}; };
+
+    static std::pair<std::size_t, std::size_t> StopRecording(const std::string &name) { if (IsEnabled()) return __StopRecording(name); return {0, 0}; };
+
+    static void Erase(const std::string &name) { __Erase(name); };
+
+    static void ResetAll() { __ResetAll(); };
+
+    static void Reset(const std::string &name) { __Reset(name); };
+
+    static void ReportAll() { __ReportAll(); };
+
+    static void ReportThreads() { __ReportThreads(); };
+
+    static void Report(const std::string &name, bool recursive=true) { __Report(name, recursive); };
+
+    // Every node in pre-order, the children of a node by decreasing total time
+    static std::vector<Record> Snapshot() { return __Snapshot(); };
+
+    // Appends the rendering of a snapshot to the buffer
+    static void WriteSnapshot(const std::vector<Record> &records, Format_t format, std::string &buffer) { __WriteSnapshot(records, format, buffer); };
+
+    static void WriteSnapshot(const std::vector<Record> &records, Format_t format, std::ostream &stream) { __WriteSnapshot(records, format, stream); };
+
+    // Measures the overhead of an empty Start/Stop pair and of a clock read, on a thread of its own
+    static Overhead Calibrate() { return __Calibrate(); };
+
+    // Last calibration, calibrates first if there was none
+    static Overhead GetOverhead() { return __GetOverhead(); };
+
+    // Subtracts the calibrated overhead of the timer from the totals, averages and ratios of the reports
+    static void SetOverheadCorrection(bool correction) { __SetOverheadCorrection(correction); };
+
+    // Records one in period invocations of every node carrying the name, counted per thread, and weighs each recorded
+    // one by the period in the reports. 1 records every invocation.
+    static void SetSampling(const std::string &name, std::size_t period) { __SetSampling(name, period); };
+
+    // Raises the sampling period of each node on each thread so that the calibrated Start/Stop cost stays under
+    // percent of its recorded time, 0 turns it off
+    static void SetSamplingBudget(double percent) { __SetSamplingBudget(percent); };
+
+    // Keeps, on each thread, the count slowest invocations of every node carrying the name that last at least
+    // threshold in the node time unit, with the invocations that stopped inside them. Up to 16, 0 turns it off.
+    static void SetExemplars(const std::string &name, std::size_t count, double threshold = 0) { __SetExemplars(name, count, threshold); };
+
+    // The count slowest kept invocations of each node over all threads, slowest first
+    static std::vector<Exemplar> Exemplars() { return __Exemplars(); };
+
+    static void ReportExemplars() { __ReportExemplars(); };
+
+    // Every interval_ms, a background thread writes the calls, time and latency quantiles of every node during the
+    // interval, and the totals, in OpenMetrics text format. The file at path is replaced each time, or with
+    // unix_socket, every client connecting to the socket at path receives the latest text.
+    static void StartExporter(const std::string &path, std::size_t interval_ms = 10000, bool unix_socket = false) { __StartExporter(path, interval_ms, unix_socket); };
+
+    static void StopExporter() { __StopExporter(); };
+
+    // Also reads the CPU time and the context switch counts of the thread whenever a recorder starts or stops being
+    // active on it, the reports then show the CPU time, the off-CPU time and the voluntary and involuntary switches.
+    // Each reading costs two system calls.
+    static void SetCpuTime(bool cpu_time) { __SetCpuTime(cpu_time); };
+
+    // Also counts cycles, instructions, cache misses and branch misses through perf_event_open like the CPU time,
+    // the reports then show the IPC and the misses per call. Without a hardware PMU the task-clock and the page
+    // faults are counted instead. Throws when perf_event_open is not permitted.
+    static void SetPerfCounters(bool perf_counters) { __SetPerfCounters(perf_counters); };
+
+    // Charges the heap allocations of each thread to its innermost active recorder, the reports then show the
+    // allocations and bytes per call and the peak growth of the live heap of the thread while the recorder was active.
+    // The allocations of the timer itself are not charged.
+    // Needs TimerNew.cpp or the TimerMalloc library, see TimerAlloc.h.
+    static void SetAllocationTracking(bool allocation_tracking) { __SetAllocationTracking(allocation_tracking); };
+
+    // Appends a begin/end event of every recording to a per-thread ring buffer of events_per_thread entries,
+    // a background thread streams them to the file at path. Convert it with timer_trace2json.
+    static void StartTracing(const std::string &path, std::size_t events_per_thread = 1 << 16) { __StartTracing(path, events_per_thread); };
+
+    static void StopTracing() { __StopTracing(); };
+
+#else
+    // Compiled out: the calls vanish at any optimization level, string arguments are never built,
+    // and nothing from Timer.cpp is referenced
+    template<typename ...Args> [[gnu::always_inline]] static bool IsEnabled(const Args &...) { return false; }
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetEnabled(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetToggleSignal(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetDefaultTimeUnit(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetAutoParent(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static Handle Register(const Args &...) { return Handle{0, ms, false}; }
+
+    template<typename ...Args> [[gnu::always_inline]] static Token Start(const Args &...) { return Token{0, 0}; }
+
+    template<typename ...Args> [[gnu::always_inline]] static std::pair<std::size_t, std::size_t> Stop(const Args &...) { return {0, 0}; }
+
+    template<typename ...Args> [[gnu::always_inline]] static Token StartRecording(const Args &...) { return Token{0, 0}; }
+
+    template<typename ...Args> [[gnu::always_inline]] static std::pair<std::size_t, std::size_t> StopRecording(const Args &...) { return {0, 0}; }
 
-    static void StartRecording(const std::string &name, TimeUnit_t time_unit = default_time_unit_) { if (TIMER_USE_TIMER) __StartRecording(name, time_unit); };
+    template<typename ...Args> [[gnu::always_inline]] static void Erase(const Args &...) {}
 
-    static void StartRecording(const std::string &name, const std::string &father_name, TimeUnit_t time_unit = default_time_unit_) { if (TIMER_USE_TIMER) __StartRecording(name, father_name, time_unit); };
+    template<typename ...Args> [[gnu::always_inline]] static void ResetAll(const Args &...) {}
 
-    static std::pair<std::size_t, std::size_t> StopRecording(const std::string &name) { if (TIMER_USE_TIMER) return __StopRecording(name); };
+    template<typename ...Args> [[gnu::always_inline]] static void Reset(const Args &...) {}
 
-    static void Erase(const std::string &name) { if (TIMER_USE_TIMER) __Erase(name); };
+    template<typename ...Args> [[gnu::always_inline]] static void ReportAll(const Args &...) {}
 
-    static void ResetAll() { if (TIMER_USE_TIMER) __ResetAll(); };
+    template<typename ...Args> [[gnu::always_inline]] static void ReportThreads(const Args &...) {}
 
-    static void Reset(const std::string &name) { if (TIMER_USE_TIMER) __Reset(name); };
+    template<typename ...Args> [[gnu::always_inline]] static void Report(const Args &...) {}
 
-    static void ReportAll() { if (TIMER_USE_TIMER) __ReportAll(); };
+    template<typename ...Args> [[gnu::always_inline]] static std::vector<Record> Snapshot(const Args &...) { return {}; }
 
-    static void Report(const std::string &name, bool recursive=true) { if (TIMER_USE_TIMER) __Report(name, recursive); };
+    template<typename ...Args> [[gnu::always_inline]] static void WriteSnapshot(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static Overhead Calibrate(const Args &...) { return Overhead{0, 0, 0}; }
+
+    template<typename ...Args> [[gnu::always_inline]] static Overhead GetOverhead(const Args &...) { return Overhead{0, 0, 0}; }
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetOverheadCorrection(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetSampling(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetSamplingBudget(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetExemplars(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static std::vector<Exemplar> Exemplars(const Args &...) { return {}; }
+
+    template<typename ...Args> [[gnu::always_inline]] static void ReportExemplars(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void StartExporter(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void StopExporter(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetCpuTime(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetPerfCounters(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void SetAllocationTracking(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void StartTracing(const Args &...) {}
+
+    template<typename ...Args> [[gnu::always_inline]] static void StopTracing(const Args &...) {}
+
+#endif
 
 private:
+#if TIMER_USE_TIMER
+    static void __SetEnabled(bool enabled);
+
+    static void __SetToggleSignal(int signal);
+
     static void __SetDefaultTimeUnit(TimeUnit_t default_time_unit);
 
-    static void __StartRecording(const std::string &name, TimeUnit_t time_unit);
+    static void __SetAutoParent(bool auto_parent);
+
+    static Handle __Register(const std::string &name, TimeUnit_t time_unit);
+
+    static Handle __Register(const std::string &name, const std::string &father_name, TimeUnit_t time_unit);
 
-    static void __StartRecording(const std::string &name, const std::string &father_name, TimeUnit_t time_unit);
+    static Token __Start(Handle handle);
+
+    static std::pair<std::size_t, std::size_t> __Stop(Handle handle);
+
+    static std::pair<std::size_t, std::size_t> __Stop(Token token);
+
+    static Token __StartRecording(const std::string &name, TimeUnit_t time_unit);
+
+    static Token __StartRecording(const std::string &name, const std::string &father_name, TimeUnit_t time_unit);
 
     static std::pair<std::size_t, std::size_t> __StopRecording(const std::string &name);
 
@@ -51,10 +321,79 @@ private:
 
     static void __ReportAll();
 
+    static void __ReportThreads();
+
     static void __Report(const std::string &name, bool recursive=false);
 
+    static std::vector<Record> __Snapshot();
+
+    static void __WriteSnapshot(const std::vector<Record> &records, Format_t format, std::string &buffer);
+
+    static void __WriteSnapshot(const std::vector<Record> &records, Format_t format, std::ostream &stream);
+
+    static Overhead __Calibrate();
+
+    static Overhead __GetOverhead();
+
+    static void __SetOverheadCorrection(bool correction);
+
+    static void __SetSampling(const std::string &name, std::size_t period);
+
+    static void __SetSamplingBudget(double percent);
+
+    static void __SetExemplars(const std::string &name, std::size_t count, double threshold);
+
+    static std::vector<Exemplar> __Exemplars();
+
+    static void __ReportExemplars();
+
+    static void __StartExporter(const std::string &path, std::size_t interval_ms, bool unix_socket);
+
+    static void __StopExporter();
+
+    static void __SetCpuTime(bool cpu_time);
+
+    static void __SetPerfCounters(bool perf_counters);
+
+    static void __SetAllocationTracking(bool allocation_tracking);
+
+    static void __StartTracing(const std::string &path, std::size_t events_per_thread);
+
+    static void __StopTracing();
+
+    static std::atomic<bool> enabled_;
+
     // default is "ms"
     static TimeUnit_t default_time_unit_;
+#endif
+};
+
+// Starts a recorder on construction and stops it on destruction
+class Timer::Scope final {
+public:
+    [[gnu::always_inline]] explicit Scope(Handle handle) : token_(Start(handle)) {}
+
+    [[gnu::always_inline]] ~Scope() { Stop(token_); }
+
+    Scope(const Scope &) = delete;
+
+    Scope &operator=(const Scope &) = delete;
+
+private:
+    const Token token_;
 };
 
+#define TIMER_CONCAT_IMPL(a, b) a##b
+#define TIMER_CONCAT(a, b) TIMER_CONCAT_IMPL(a, b)
+
+// Times the rest of the enclosing block, arguments are the ones of Timer::Register.
+// The node is resolved once through a function-local static, later passes only read the clock twice.
+#if TIMER_USE_TIMER
+#define TIMER_SCOPE(...) \
+    static const Timer::Handle TIMER_CONCAT(timer_handle_, __LINE__){Timer::Register(__VA_ARGS__)}; \
+    const Timer::Scope TIMER_CONCAT(timer_scope_, __LINE__){TIMER_CONCAT(timer_handle_, __LINE__)}
+#else
+#define TIMER_SCOPE(...) static_cast<void>(0)
+#endif
+
 #endif //TIMER_TIMER_H
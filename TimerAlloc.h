@@ -0,0 +1,25 @@
+//
+// Created by Jie Ren (jieren9806@gmail.com) on 2021/10/21.
+//
+
+#ifndef TIMER_TIMERALLOC_H
+#define TIMER_TIMERALLOC_H
+
+#include <cstddef>
+
+// Hooks through which the allocation modules report the heap to Timer.cpp: TimerNew.cpp replaces the global
+// operator new/delete, the TimerMalloc library interposes malloc. Link one of them, not both.
+// Sizes are the usable sizes of the blocks, so that a free subtracts what its allocation added.
+// The hooks do nothing until Timer::SetAllocationTracking(true), and never allocate.
+struct TimerAlloc final {
+    TimerAlloc() = delete;
+
+    // called by the module at load time, SetAllocationTracking(true) throws without a module
+    static void Install() noexcept;
+
+    static void Allocate(std::size_t size) noexcept;
+
+    static void Deallocate(std::size_t size) noexcept;
+};
+
+#endif //TIMER_TIMERALLOC_H
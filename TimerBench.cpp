@@ -0,0 +1,283 @@
+//
+// Created by Jie Ren (jieren9806@gmail.com) on 2021/10/21.
+//
+
+// Measures the cost of the timer itself, to compare versions of the library.
+// Usage: timer_bench [--csv | --json] [--quick]
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "Timer.h"
+
+namespace {
+    struct Result {
+        std::string benchmark_;
+        std::string parameter_;
+        std::size_t value_;
+        std::size_t threads_;
+        // one per Start/Stop pair, per pair of a chain for the depth benchmark, or per call for the report benchmark
+        std::vector<double> samples_;
+    };
+
+    std::size_t sample_count_ = 200000;
+
+    // cost of the clock read of the benchmark, subtracted from every sample
+    double clock_ns_ = 0;
+
+    double Now() {
+        return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    double getPercentile(const std::vector<double> &sorted, double quantile) {
+        if (sorted.empty())
+            return 0;
+        return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(quantile * sorted.size()))];
+    }
+
+    // the fastest of many back-to-back clock reads, so that a sample is never charged for the benchmark's own read
+    void CalibrateClock() {
+        clock_ns_ = std::numeric_limits<double>::max();
+        for (std::size_t read = 0; read < 100000; ++read) {
+            const double begin = Now();
+            clock_ns_ = std::min(clock_ns_, Now() - begin);
+        }
+    }
+
+    // runs body(sample index) sample_count_ times and keeps the latency of each call divided by pairs_per_call,
+    // so that the percentiles describe single pairs and keep their outliers
+    template<typename Body>
+    std::vector<double> Measure(Body &&body, std::size_t pairs_per_call = 1) {
+        std::vector<double> samples;
+        samples.reserve(sample_count_);
+        for (std::size_t sample = 0; sample < sample_count_; ++sample) {
+            const double begin = Now();
+            body(sample);
+            samples.push_back(std::max(0.0, Now() - begin - clock_ns_) / pairs_per_call);
+        }
+        return samples;
+    }
+
+    // distinct names, the same length for every index
+    std::string getName(const std::string &prefix, std::size_t index, std::size_t length = 0) {
+        std::string name = prefix + std::to_string(index);
+        if (name.size() < length)
+            name.insert(prefix.size(), length - name.size(), '_');
+        return name;
+    }
+
+    // registered names are erased after each benchmark so that the tree does not grow from one to the next
+    void EraseAll(const std::vector<std::string> &names) {
+        for (const auto &name: names)
+            Timer::Erase(name);
+    }
+
+    // pairs on nodes visited in a scattered order, from a tree of node_count siblings
+    Result BenchNodes(std::size_t node_count) {
+        std::vector<std::string> names;
+        std::vector<Timer::Handle> handles;
+        for (std::size_t index = 0; index < node_count; ++index) {
+            names.push_back(getName("nodes/", index));
+            handles.push_back(Timer::Register(names.back(), Timer::ns));
+        }
+        // the first stop of a node allocates its histogram, keep it out of the samples
+        for (const auto &handle: handles) {
+            Timer::Start(handle);
+            Timer::Stop(handle);
+        }
+        std::size_t cursor = 0;
+        Result result{"handle_pair", "nodes", node_count, 1, Measure([&](std::size_t) {
+            // 7919 is prime, every node is visited once per node_count pairs
+            cursor = (cursor + 7919) % node_count;
+            Timer::Start(handles[cursor]);
+            Timer::Stop(handles[cursor]);
+        })};
+        EraseAll(names);
+        return result;
+    }
+
+    // a chain of depth nested recorders started and stopped together
+    Result BenchDepth(std::size_t depth) {
+        std::vector<std::string> names;
+        std::vector<Timer::Handle> handles;
+        for (std::size_t level = 0; level < depth; ++level) {
+            names.push_back(getName("depth/", level));
+            handles.push_back(level == 0 ? Timer::Register(names.back(), Timer::ns)
+                                         : Timer::Register(names.back(), names[level - 1], Timer::ns));
+        }
+        Result result{"handle_pair", "depth", depth, 1, Measure([&](std::size_t) {
+            for (const auto &handle: handles)
+                Timer::Start(handle);
+            for (auto handle = handles.rbegin(); handle != handles.rend(); ++handle)
+                Timer::Stop(*handle);
+        }, depth)};
+        Timer::Erase(names.front());
+        return result;
+    }
+
+    // StartRecording/StopRecording looking up names of the given length, then Start/Stop on the handles of the same
+    // recorders in the same order, so that both APIs are compared on the same nodes
+    std::vector<Result> BenchNameLength(std::size_t length) {
+        constexpr std::size_t kNames = 16;
+        std::vector<std::string> names;
+        std::vector<Timer::Handle> handles;
+        for (std::size_t index = 0; index < kNames; ++index) {
+            names.push_back(getName("name/", index, length));
+            handles.push_back(Timer::Register(names.back(), Timer::ns));
+        }
+        // the first stop of a node allocates its histogram and the first lookup fills the name cache
+        for (const auto &name: names) {
+            Timer::StartRecording(name, Timer::ns);
+            Timer::StopRecording(name);
+        }
+        std::vector<Result> results;
+        results.push_back(Result{"string_pair", "name_length", length, 1, Measure([&](std::size_t sample) {
+            const std::string &name = names[sample % kNames];
+            Timer::StartRecording(name, Timer::ns);
+            Timer::StopRecording(name);
+        })});
+        results.push_back(Result{"handle_pair", "name_length", length, 1, Measure([&](std::size_t sample) {
+            const Timer::Handle &handle = handles[sample % kNames];
+            Timer::Start(handle);
+            Timer::Stop(handle);
+        })});
+        EraseAll(names);
+        return results;
+    }
+
+    // every thread records its own node, all threads start together
+    Result BenchThreads(std::size_t thread_count) {
+        std::vector<std::string> names;
+        std::vector<Timer::Handle> handles;
+        for (std::size_t index = 0; index < thread_count; ++index) {
+            names.push_back(getName("threads/", index));
+            handles.push_back(Timer::Register(names.back(), Timer::ns));
+        }
+        std::vector<std::vector<double>> samples(thread_count);
+        std::atomic<std::size_t> ready{0};
+        std::vector<std::thread> threads;
+        for (std::size_t index = 0; index < thread_count; ++index) {
+            threads.emplace_back([&, index] {
+                ready.fetch_add(1);
+                while (ready.load() != thread_count)
+                    std::this_thread::yield();
+                samples[index] = Measure([&](std::size_t) {
+                    Timer::Start(handles[index]);
+                    Timer::Stop(handles[index]);
+                });
+            });
+        }
+        for (auto &thread: threads)
+            thread.join();
+        Result result{"handle_pair", "threads", thread_count, thread_count, {}};
+        for (const auto &thread_samples: samples)
+            result.samples_.insert(result.samples_.end(), thread_samples.begin(), thread_samples.end());
+        EraseAll(names);
+        return result;
+    }
+
+    // ReportAll on a tree of node_count recorders, 10 children per node, printed into a discarding stream
+    Result BenchReport(std::size_t node_count) {
+        std::vector<std::string> names{"report/0"};
+        std::vector<Timer::Handle> handles{Timer::Register(names.back())};
+        for (std::size_t index = 1; index < node_count; ++index) {
+            names.push_back(getName("report/", index));
+            handles.push_back(Timer::Register(names.back(), names[(index - 1) / 10]));
+        }
+        for (const auto &handle: handles) {
+            Timer::Start(handle);
+            Timer::Stop(handle);
+        }
+        std::ostringstream discard;
+        std::streambuf *const buffer = std::cout.rdbuf(discard.rdbuf());
+        const std::size_t saved_count = sample_count_;
+        sample_count_ = std::max<std::size_t>(3, sample_count_ / 10000);
+        Result result{"report_all", "nodes", node_count, 1, Measure([&](std::size_t) {
+            discard.str(std::string{});
+            Timer::ReportAll();
+        })};
+        sample_count_ = saved_count;
+        std::cout.rdbuf(buffer);
+        Timer::Erase(names.front());
+        return result;
+    }
+
+    void PrintCsv(const std::vector<Result> &results) {
+        std::cout << "benchmark,parameter,value,threads,samples,min_ns,p50_ns,p90_ns,p99_ns,max_ns\n";
+        for (const auto &result: results) {
+            std::cout << result.benchmark_ << ',' << result.parameter_ << ',' << result.value_ << ','
+                      << result.threads_ << ',' << result.samples_.size() << ',' << result.samples_.front() << ','
+                      << getPercentile(result.samples_, 0.5) << ',' << getPercentile(result.samples_, 0.9) << ','
+                      << getPercentile(result.samples_, 0.99) << ',' << result.samples_.back() << '\n';
+        }
+    }
+
+    void PrintJson(const std::vector<Result> &results) {
+        std::cout << "{\"results\":[";
+        bool first = true;
+        for (const auto &result: results) {
+            std::cout << (first ? "\n" : ",\n")
+                      << "{\"benchmark\":\"" << result.benchmark_ << "\",\"parameter\":\"" << result.parameter_
+                      << "\",\"value\":" << result.value_ << ",\"threads\":" << result.threads_
+                      << ",\"samples\":" << result.samples_.size() << ",\"min_ns\":" << result.samples_.front()
+                      << ",\"p50_ns\":" << getPercentile(result.samples_, 0.5)
+                      << ",\"p90_ns\":" << getPercentile(result.samples_, 0.9)
+                      << ",\"p99_ns\":" << getPercentile(result.samples_, 0.99)
+                      << ",\"max_ns\":" << result.samples_.back() << "}";
+            first = false;
+        }
+        std::cout << "\n]}\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    bool quick = false;
+    for (int index = 1; index < argc; ++index) {
+        if (std::strcmp(argv[index], "--json") == 0) {
+            json = true;
+        } else if (std::strcmp(argv[index], "--csv") == 0) {
+            json = false;
+        } else if (std::strcmp(argv[index], "--quick") == 0) {
+            quick = true;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--csv | --json] [--quick]" << std::endl;
+            return 2;
+        }
+    }
+    if (quick)
+        sample_count_ = 20000;
+    CalibrateClock();
+
+    std::vector<Result> results;
+    // first, erased recorders still occupy ids that a report walks through
+    for (std::size_t node_count = 1000; node_count <= (quick ? 10000 : 100000); node_count *= 10)
+        results.push_back(BenchReport(node_count));
+    for (std::size_t node_count = 10; node_count <= 100000; node_count *= 10)
+        results.push_back(BenchNodes(node_count));
+    for (std::size_t depth = 1; depth <= 64; depth *= 4)
+        results.push_back(BenchDepth(depth));
+    for (std::size_t length: {8, 32, 128, 512}) {
+        const std::vector<Result> length_results = BenchNameLength(length);
+        results.insert(results.end(), length_results.begin(), length_results.end());
+    }
+    const std::size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+        results.push_back(BenchThreads(thread_count));
+
+    for (auto &result: results)
+        std::sort(result.samples_.begin(), result.samples_.end());
+    if (json)
+        PrintJson(results);
+    else
+        PrintCsv(results);
+    return std::cout ? 0 : 1;
+}
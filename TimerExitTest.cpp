@@ -0,0 +1,25 @@
+//
+// Created by Jie Ren (jieren9806@gmail.com) on 2021/10/21.
+//
+
+// Returns from main while tracing and exporting, the exit handlers of the library must join its threads and complete
+// the files.
+// Usage: timer_exit_test <trace file> <metrics file>
+
+#include <iostream>
+#include "Timer.h"
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " <trace file> <metrics file>" << std::endl;
+        return 2;
+    }
+    Timer::StartTracing(argv[1]);
+    Timer::StartExporter(argv[2], 1);
+    const Timer::Handle handle = Timer::Register("work", Timer::ns);
+    for (int i = 0; i < 1000; ++i) {
+        Timer::Start(handle);
+        Timer::Stop(handle);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+//
+// Created by Jie Ren (jieren9806@gmail.com) on 2021/10/21.
+//
+
+// Interposes the malloc family of glibc to charge every heap allocation, including the ones of C code, to the active
+// recorders, see TimerAlloc.h. Link the TimerMalloc library into the executable or load it with LD_PRELOAD, and call
+// Timer::SetAllocationTracking(true).
+
+#include <cerrno>
+#include <malloc.h>
+#include "TimerAlloc.h"
+
+extern "C" {
+// the allocator of glibc behind its public names
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t count, std::size_t size);
+void *__libc_realloc(void *pointer, std::size_t size);
+void *__libc_memalign(std::size_t alignment, std::size_t size);
+void *__libc_valloc(std::size_t size);
+void *__libc_pvalloc(std::size_t size);
+void __libc_free(void *pointer);
+}
+
+namespace {
+    void *Charge(void *pointer) {
+        if (pointer != nullptr)
+            TimerAlloc::Allocate(malloc_usable_size(pointer));
+        return pointer;
+    }
+
+    bool isPowerOfTwo(std::size_t value) { return value != 0 && (value & (value - 1)) == 0; }
+
+    // tells Timer.cpp at load time that the hooks are in place
+    const struct Installer {
+        Installer() noexcept { TimerAlloc::Install(); }
+    } installer_;
+}
+
+// every function glibc documents for replacing malloc, so that no block is allocated or freed behind the hooks
+extern "C" {
+
+void *malloc(std::size_t size) { return Charge(__libc_malloc(size)); }
+
+void *calloc(std::size_t count, std::size_t size) { return Charge(__libc_calloc(count, size)); }
+
+void *realloc(void *pointer, std::size_t size) {
+    const std::size_t old_size = pointer == nullptr ? 0 : malloc_usable_size(pointer);
+    void *const result = __libc_realloc(pointer, size);
+    // a failed realloc keeps the block, realloc(pointer, 0) frees it
+    if (result == nullptr && size != 0)
+        return nullptr;
+    if (pointer != nullptr)
+        TimerAlloc::Deallocate(old_size);
+    return Charge(result);
+}
+
+void free(void *pointer) {
+    if (pointer == nullptr)
+        return;
+    TimerAlloc::Deallocate(malloc_usable_size(pointer));
+    __libc_free(pointer);
+}
+
+void *memalign(std::size_t alignment, std::size_t size) { return Charge(__libc_memalign(alignment, size)); }
+
+void *aligned_alloc(std::size_t alignment, std::size_t size) { return Charge(__libc_memalign(alignment, size)); }
+
+void *valloc(std::size_t size) { return Charge(__libc_valloc(size)); }
+
+void *pvalloc(std::size_t size) { return Charge(__libc_pvalloc(size)); }
+
+int posix_memalign(void **result, std::size_t alignment, std::size_t size) {
+    if (!isPowerOfTwo(alignment) || alignment % sizeof(void *) != 0)
+        return EINVAL;
+    void *const pointer = __libc_memalign(alignment, size);
+    if (pointer == nullptr)
+        return ENOMEM;
+    *result = Charge(pointer);
+    return 0;
+}
+}
@@ -0,0 +1,70 @@
+//
+// Created by Jie Ren (jieren9806@gmail.com) on 2021/10/21.
+//
+
+// Replaces the global operator new/delete to charge heap allocations to the active recorders, see TimerAlloc.h.
+// Compile it into the executable, e.g., through the TimerNew object library, and call Timer::SetAllocationTracking(true).
+// The over-aligned forms of C++17 are left to the standard library and not counted.
+
+#include <new>
+#include <cstdlib>
+#include <malloc.h>
+#include "TimerAlloc.h"
+
+namespace {
+    void *Allocate(std::size_t size) {
+        for (;;) {
+            void *pointer = std::malloc(size == 0 ? 1 : size);
+            if (pointer != nullptr) {
+                TimerAlloc::Allocate(malloc_usable_size(pointer));
+                return pointer;
+            }
+            const std::new_handler handler = std::get_new_handler();
+            if (handler == nullptr)
+                throw std::bad_alloc{};
+            handler();
+        }
+    }
+
+    void *Allocate(std::size_t size, const std::nothrow_t &) noexcept {
+        try {
+            return Allocate(size);
+        } catch (...) {
+            return nullptr;
+        }
+    }
+
+    void Deallocate(void *pointer) noexcept {
+        if (pointer == nullptr)
+            return;
+        TimerAlloc::Deallocate(malloc_usable_size(pointer));
+        std::free(pointer);
+    }
+
+    // tells Timer.cpp at load time that the hooks are in place
+    const struct Installer {
+        Installer() noexcept { TimerAlloc::Install(); }
+    } installer_;
+}
+
+void *operator new(std::size_t size) { return Allocate(size); }
+
+void *operator new[](std::size_t size) { return Allocate(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &tag) noexcept { return Allocate(size, tag); }
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept { return Allocate(size, tag); }
+
+void operator delete(void *pointer) noexcept { Deallocate(pointer); }
+
+void operator delete[](void *pointer) noexcept { Deallocate(pointer); }
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept { Deallocate(pointer); }
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept { Deallocate(pointer); }
+
+#if __cpp_sized_deallocation
+void operator delete(void *pointer, std::size_t) noexcept { Deallocate(pointer); }
+
+void operator delete[](void *pointer, std::size_t) noexcept { Deallocate(pointer); }
+#endif
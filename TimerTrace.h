@@ -0,0 +1,58 @@
+//
+// Created by Jie Ren (jieren9806@gmail.com) on 2021/10/21.
+//
+
+#ifndef TIMER_TIMERTRACE_H
+#define TIMER_TIMERTRACE_H
+
+#include <cstdint>
+
+// Layout of the binary trace written by Timer::StartTracing:
+// FileHeader, event_count_ Events, then name_count_ NameRecords each followed by length_ bytes of name.
+struct TimerTrace final {
+    TimerTrace() = delete;
+
+    static constexpr uint32_t kVersion = 1;
+    // set in Event::id_ for the end of a recording
+    static constexpr uint32_t kEndFlag = 0x80000000u;
+
+    struct FileHeader {
+        char magic_[8];
+        uint32_t version_;
+        uint32_t event_size_;
+        double ticks_per_second_;
+        uint64_t event_count_;
+        uint64_t names_offset_;
+        uint64_t name_count_;
+        // events lost because a thread filled its ring buffer faster than it was flushed
+        uint64_t dropped_count_;
+    };
+
+    struct Event {
+        int64_t ticks_;
+        uint32_t id_;
+        uint32_t thread_;
+    };
+
+    struct NameRecord {
+        uint32_t id_;
+        uint32_t parent_;
+        uint32_t length_;
+    };
+
+    static bool CheckMagic(const char *magic) {
+        static const char expected[8]{'T', 'I', 'M', 'E', 'R', 'T', 'R', 'C'};
+        for (int i = 0; i < 8; ++i)
+            if (magic[i] != expected[i])
+                return false;
+        return true;
+    }
+
+    static void SetMagic(char *magic) {
+        static const char expected[8]{'T', 'I', 'M', 'E', 'R', 'T', 'R', 'C'};
+        for (int i = 0; i < 8; ++i)
+            magic[i] = expected[i];
+    }
+};
+
+#endif //TIMER_TIMERTRACE_H
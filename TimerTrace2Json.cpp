@@ -0,0 +1,149 @@
+//
+// Created by Jie Ren (jieren9806@gmail.com) on 2021/10/21.
+//
+
+// Converts a trace written by Timer::StartTracing into Chrome trace-event JSON, which Perfetto and chrome://tracing open.
+// Usage: timer_trace2json <trace file> [json file]
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include "TimerTrace.h"
+
+namespace {
+    struct NameEntry {
+        uint32_t parent_;
+        std::string name_;
+    };
+
+    std::string Escape(const std::string &text) {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (const char c: text) {
+            switch (c) {
+                case '"':
+                    escaped += "\\\"";
+                    break;
+                case '\\':
+                    escaped += "\\\\";
+                    break;
+                case '\n':
+                    escaped += "\\n";
+                    break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        static const char hex[] = "0123456789abcdef";
+                        escaped += "\\u00";
+                        escaped += hex[(c >> 4) & 0xf];
+                        escaped += hex[c & 0xf];
+                    } else {
+                        escaped += c;
+                    }
+            }
+        }
+        return escaped;
+    }
+
+    std::string getPath(const std::unordered_map<uint32_t, NameEntry> &names, uint32_t id) {
+        std::string path;
+        for (auto find = names.find(id); find != names.end(); find = names.find(find->second.parent_))
+            path = path.empty() ? find->second.name_ : find->second.name_ + "/" + path;
+        return path;
+    }
+
+    template<typename T>
+    bool Read(const std::vector<char> &data, std::size_t &offset, T &value) {
+        if (offset + sizeof(T) > data.size())
+            return false;
+        std::memcpy(&value, data.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return true;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "usage: " << argv[0] << " <trace file> [json file]" << std::endl;
+        return 2;
+    }
+    std::ifstream input{argv[1], std::ios::binary};
+    if (!input) {
+        std::cerr << "cannot open {" << argv[1] << "}" << std::endl;
+        return 1;
+    }
+    const std::vector<char> data{std::istreambuf_iterator<char>{input}, std::istreambuf_iterator<char>{}};
+
+    std::size_t offset = 0;
+    TimerTrace::FileHeader header{};
+    if (!Read(data, offset, header) || !TimerTrace::CheckMagic(header.magic_) ||
+        header.version_ != TimerTrace::kVersion || header.event_size_ != sizeof(TimerTrace::Event)) {
+        std::cerr << "{" << argv[1] << "} is not a complete timer trace" << std::endl;
+        return 1;
+    }
+
+    std::unordered_map<uint32_t, NameEntry> names;
+    offset = header.names_offset_;
+    for (uint64_t i = 0; i < header.name_count_; ++i) {
+        TimerTrace::NameRecord record{};
+        if (!Read(data, offset, record) || offset + record.length_ > data.size()) {
+            std::cerr << "truncated name table" << std::endl;
+            return 1;
+        }
+        names[record.id_] = NameEntry{record.parent_, std::string{data.data() + offset, record.length_}};
+        offset += record.length_;
+    }
+
+    std::vector<TimerTrace::Event> events(header.event_count_);
+    offset = sizeof(TimerTrace::FileHeader);
+    if (offset + events.size() * sizeof(TimerTrace::Event) > data.size()) {
+        std::cerr << "truncated event list" << std::endl;
+        return 1;
+    }
+    if (!events.empty())
+        std::memcpy(events.data(), data.data() + offset, events.size() * sizeof(TimerTrace::Event));
+    int64_t origin = std::numeric_limits<int64_t>::max();
+    for (const auto &event: events)
+        origin = std::min(origin, event.ticks_);
+
+    std::ofstream file;
+    if (argc == 3) {
+        file.open(argv[2]);
+        if (!file) {
+            std::cerr << "cannot open {" << argv[2] << "}" << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &output = argc == 3 ? file : std::cout;
+
+    std::unordered_map<uint32_t, std::string> escaped;
+    output << "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":" << header.dropped_count_
+           << "},\"traceEvents\":[";
+    output << std::fixed << std::setprecision(3);
+    bool first = true;
+    for (const auto &event: events) {
+        const uint32_t id = event.id_ & ~TimerTrace::kEndFlag;
+        auto find = escaped.find(id);
+        if (find == escaped.end()) {
+            const std::string path = getPath(names, id);
+            find = escaped.emplace(id, Escape(path.empty() ? "#" + std::to_string(id) : path)).first;
+        }
+        const std::string &path = find->second;
+        const std::size_t slash = path.rfind('/');
+        output << (first ? "\n" : ",\n")
+               << "{\"name\":\"" << (slash == std::string::npos ? path : path.substr(slash + 1))
+               << "\",\"cat\":\"timer\",\"ph\":\"" << ((event.id_ & TimerTrace::kEndFlag) ? 'E' : 'B')
+               << "\",\"ts\":" << (event.ticks_ - origin) * 1e6 / header.ticks_per_second_
+               << ",\"pid\":1,\"tid\":" << event.thread_
+               << ",\"args\":{\"path\":\"" << path << "\"}}";
+        first = false;
+    }
+    output << "\n]}" << std::endl;
+    if (header.dropped_count_ != 0)
+        std::cerr << header.dropped_count_ << " event(s) were dropped because a ring buffer was full" << std::endl;
+    return output ? 0 : 1;
+}